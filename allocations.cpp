@@ -0,0 +1,122 @@
+// Checks that typing and cursor motion don't allocate once warmed up:
+// every allocation goes through a counting operator new, and the program
+// fails, naming the key, if any keystroke of the script allocated.
+//
+//     c++ -std=c++23 -O2 -pthread allocations.cpp -o epp-allocations
+//     ./epp-allocations
+
+#include "epp.hpp"
+
+#include <cstdlib>
+#include <new>
+
+std::size_t allocations = 0;
+
+auto operator new(std::size_t size) -> void * {
+    ++allocations;
+
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] auto operator delete(void *p) noexcept -> void {
+    std::free(p);
+}
+
+[[gnu::noinline]] auto operator delete(void *p, std::size_t) noexcept -> void {
+    std::free(p);
+}
+
+// typing, deleting what was typed and moving around, so every pass over
+// the script leaves the text as it found it
+constexpr std::string_view script =
+    "hello, world\t"
+    "\x7f\x7f\x7f\x7f\x7f\x7f\x7f\x7f\x7f\x7f\x7f\x7f\x7f\x7f\x7f\x7f"
+    "FFBBNNPPAEVCNPBF";
+
+auto check(std::string_view name, bool wrap) -> bool {
+    Editor editor;
+    Tui tui(80, 24);
+    Frame frame;
+    std::vector<std::string> text;
+
+    for (int i = 0; i < 200; ++i) {
+        switch (i % 4) {
+        case 0:
+            text.push_back("plain ascii text that is long enough to need a heap buffer");
+            break;
+        case 1:
+            text.push_back("héllo 世界 éx 👍🏽 and then enough text to wrap at eighty columns, again and again");
+            break;
+        case 2:
+            text.push_back("a\tb\tc\td");
+            break;
+        case 3:
+            text.push_back(std::string(300, 'x'));
+            break;
+        }
+    }
+
+    editor.wrap = wrap;
+    editor.assign(std::move(text));
+
+    // the undo log grows with every edit; steady state means it has room
+    editor.history.log.reserve(1 << 20);
+
+    auto press = [&](char c) {
+        apply(editor, Event{Event::key, c});
+        compose(editor, tui, frame);
+        draw(tui, frame);
+    };
+
+    auto place = [&](int start) {
+        editor.line = start;
+        editor.column = std::min(10, static_cast<int>(editor.lines[start].size()));
+    };
+
+    auto pass = [&](int start) {
+        place(start);
+
+        for (char c: script)
+            press(c);
+    };
+
+    // warm up on every kind of line the checked pass will touch
+    for (int round = 0; round < 3; ++round)
+        for (int start = 0; start < 8; ++start)
+            pass(start);
+
+    bool clean = true;
+
+    for (int start = 0; start < 8; ++start) {
+        place(start);
+
+        for (char c: script) {
+            std::size_t before = allocations;
+
+            press(c);
+
+            if (allocations != before) {
+                std::println("{}: line {}: key {} allocated {} times", name, start, static_cast<int>(c), allocations - before);
+                clean = false;
+            }
+        }
+    }
+
+    return clean;
+}
+
+auto main() -> int {
+    bool clean = check("no wrap", false);
+
+    clean = check("wrap", true) && clean;
+
+    if (!clean)
+        return 1;
+
+    std::println("no allocations while typing or moving");
+
+    return 0;
+}
@@ -0,0 +1,647 @@
+// Microbenchmarks for Editor and Tui operations.
+//
+//     c++ -std=c++23 -O2 -pthread bench.cpp -o epp-bench
+//     ./epp-bench [filter]
+
+#include "epp.hpp"
+
+#include <cstdio>
+#include <regex>
+
+// Deterministic synthetic text: the same seed always yields the same corpus
+struct Corpus {
+    std::uint64_t state;
+
+    explicit Corpus(std::uint64_t seed) : state(seed) {}
+
+    // splitmix64
+    auto next() -> std::uint64_t {
+        std::uint64_t z = (state += 0x9E3779B97F4A7C15);
+
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+
+        return z ^ (z >> 31);
+    }
+
+    auto below(int n) -> int {
+        return next() % n;
+    }
+
+    auto word(std::string& out) -> void {
+        int length = 1 + below(9);
+
+        for (int i = 0; i < length; ++i)
+            out += static_cast<char>('a' + below(26));
+    }
+
+    auto unicode_word(std::string& out) -> void {
+        static constexpr std::string_view pieces[] = {
+            "é", "ü", "ñ", "ø", "é", "世", "界", "語", "한", "글", "👍", "👍🏽", "🇧🇷", "ß", "я", "ж",
+        };
+
+        int length = 1 + below(6);
+
+        for (int i = 0; i < length; ++i) {
+            if (below(2))
+                out += static_cast<char>('a' + below(26));
+            else
+                out += pieces[below(std::size(pieces))];
+        }
+    }
+
+    auto short_lines(int count) -> std::vector<std::string> {
+        std::vector<std::string> lines(count);
+
+        for (auto& line: lines) {
+            int target = 20 + below(60);
+
+            while (static_cast<int>(line.size()) < target) {
+                word(line);
+                line += ' ';
+            }
+        }
+
+        return lines;
+    }
+
+    auto huge_lines(int count, std::size_t size) -> std::vector<std::string> {
+        std::vector<std::string> lines(count);
+
+        for (auto& line: lines) {
+            line.reserve(size + 10);
+
+            while (line.size() < size) {
+                word(line);
+                line += ' ';
+            }
+        }
+
+        return lines;
+    }
+
+    auto unicode_lines(int count) -> std::vector<std::string> {
+        std::vector<std::string> lines(count);
+
+        for (auto& line: lines) {
+            int words = 4 + below(12);
+
+            for (int i = 0; i < words; ++i) {
+                unicode_word(line);
+                line += ' ';
+            }
+        }
+
+        return lines;
+    }
+
+    // lines shaped like a service log: time, level, worker, client, timing
+    auto log_lines(int count) -> std::vector<std::string> {
+        static constexpr const char *levels[] = {"INFO ", "INFO ", "INFO ", "DEBUG", "WARN ", "ERROR"};
+
+        std::vector<std::string> lines(count);
+        char head[128];
+
+        for (int i = 0; i < count; ++i) {
+            auto& line = lines[i];
+
+            std::snprintf(head, sizeof(head), "2026-10-16T%02d:%02d:%02d.%03d %s [worker-%d] request %d from 10.0.%d.%d took %dms ",
+                i / 3600 % 24, i / 60 % 60, i % 60, below(1000), levels[below(6)], below(8), below(100000),
+                below(16), below(256), below(2000));
+            line = head;
+
+            int words = below(6);
+
+            for (int w = 0; w < words; ++w) {
+                word(line);
+                line += ' ';
+            }
+
+            if (line.contains("ERROR") && below(4) == 0)
+                line += "upstream timeout";
+        }
+
+        return lines;
+    }
+
+    auto tab_lines(int count, int fields) -> std::vector<std::string> {
+        std::vector<std::string> lines(count);
+
+        for (auto& line: lines) {
+            for (int i = 0; i < fields; ++i) {
+                if (i > 0)
+                    line += '\t';
+
+                word(line);
+            }
+        }
+
+        return lines;
+    }
+};
+
+struct Bench {
+    std::string_view filter;
+
+    // runs `body` `iterations` times and reports the mean time per call,
+    // followed by whatever `note` derives from it
+    auto run(std::string_view name, int iterations, auto&& body, auto&& note) -> void {
+        if (!name.contains(filter))
+            return;
+
+        auto start = std::chrono::steady_clock::now();
+
+        for (int i = 0; i < iterations; ++i)
+            body(i);
+
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+
+        std::println("{:<44} {:>9} {:>14.1f} ns/op  {}", name, iterations, ns, note(ns));
+    }
+
+    auto run(std::string_view name, int iterations, auto&& body) -> void {
+        run(name, iterations, body, [](double) { return std::string(); });
+    }
+
+    auto wanted(std::string_view name) -> bool {
+        return name.contains(filter);
+    }
+};
+
+auto bytes(std::vector<std::string> const& lines) -> std::size_t {
+    std::size_t total = 0;
+
+    for (auto& line: lines)
+        total += line.size() + 1;
+
+    return total;
+}
+
+auto editing(Bench& bench) -> void {
+    for (int length: {80, 10'000, 1'000'000}) {
+        Editor editor;
+
+        editor.assign({std::string(length, 'x')});
+        editor.column = length / 2;
+
+        int iterations = length >= 1'000'000 ? 2'000 : 200'000;
+        auto suffix = std::to_string(length);
+
+        bench.run("insert/line=" + suffix, iterations, [&](int) { editor.insert('a'); });
+        bench.run("backspace/line=" + suffix, iterations, [&](int) { editor.backspace(); });
+    }
+
+    for (int size: {1'000, 100'000, 1'000'000}) {
+        auto corpus = Corpus(1).short_lines(size);
+
+        for (auto [position, at]: {std::pair{"start", 0}, std::pair{"middle", size / 2}, std::pair{"end", size - 1}}) {
+            std::string name = "/lines=" + std::to_string(size) + "/" + position;
+
+            if (!bench.wanted("new_line" + name) && !bench.wanted("delete_line" + name))
+                continue;
+
+            Editor editor;
+
+            editor.assign(corpus);
+            editor.line = at;
+
+            int iterations = size >= 1'000'000 ? 200 : 2'000;
+
+            bench.run("new_line" + name, iterations, [&](int) { editor.new_line(editor.line); });
+            bench.run("delete_line" + name, iterations, [&](int) { editor.delete_line(); });
+        }
+
+        // a snapshot alive across each edit makes it copy its path
+        std::string name = "/lines=" + std::to_string(size);
+
+        if (!bench.wanted("snapshot" + name) && !bench.wanted("insert/snapshot" + name))
+            continue;
+
+        Editor editor;
+        Lines snapshot;
+
+        editor.assign(corpus);
+        editor.line = size / 2;
+
+        bench.run("snapshot" + name, 200'000, [&](int) { snapshot = editor.lines; });
+        bench.run("insert/snapshot" + name, 20'000, [&](int) {
+            snapshot = editor.lines;
+            editor.insert('a');
+        });
+    }
+
+    // with soft wrap every frame also maps lines to screen rows, so line
+    // counts that change between frames have to update the row counts
+    for (int size: {100'000, 1'000'000}) {
+        std::string name = "/wrap/lines=" + std::to_string(size);
+
+        if (!bench.wanted("new_line" + name) && !bench.wanted("delete_line" + name))
+            continue;
+
+        Editor editor;
+        Tui tui(120, 40);
+        Frame frame;
+
+        editor.wrap = true;
+        editor.assign(Corpus(1).short_lines(size));
+        editor.line = size / 2;
+        compose(editor, tui, frame);
+
+        bench.run("new_line" + name, 2'000, [&](int) {
+            editor.new_line(editor.line);
+            compose(editor, tui, frame);
+        });
+        bench.run("delete_line" + name, 2'000, [&](int) {
+            editor.delete_line();
+            compose(editor, tui, frame);
+        });
+    }
+}
+
+// walking a line by grapheme clusters both ways, which must stop at the
+// same places; runs of flags pair up from the start of the run
+auto graphemes(Bench& bench) -> void {
+    if (!bench.wanted("graphemes/"))
+        return;
+
+    auto lines = Corpus(17).unicode_lines(10'000);
+
+    lines.push_back("a🇧🇷🇧🇷🇧🇷 flags 🇧🇷🇧🇷🇧🇷🇧 e\u0301 👍🏽");
+
+    std::size_t steps = 0;
+    auto clusters = [&](double) { return std::to_string(std::exchange(steps, 0) / 20) + " clusters"; };
+
+    bench.run("graphemes/next", 20, [&](int) {
+        for (std::string_view line: lines)
+            for (int i = 0; i < static_cast<int>(line.size()); i = next_grapheme(line, i))
+                ++steps;
+    }, clusters);
+
+    bench.run("graphemes/previous", 20, [&](int) {
+        for (std::string_view line: lines)
+            for (int i = line.size(); i > 0; i = previous_grapheme(line, i))
+                ++steps;
+    }, clusters);
+
+    std::size_t mismatches = 0;
+    std::vector<int> starts;
+
+    for (std::string_view line: lines) {
+        starts.clear();
+
+        for (int i = 0; i < static_cast<int>(line.size()); i = next_grapheme(line, i))
+            starts.push_back(i);
+
+        int k = starts.size();
+
+        for (int i = line.size(); i > 0;) {
+            i = previous_grapheme(line, i);
+            mismatches += --k < 0 || starts[k] != i;
+        }
+
+        mismatches += k > 0;
+    }
+
+    if (mismatches > 0)
+        std::println("{} grapheme boundaries differ between next_grapheme and previous_grapheme", mismatches);
+}
+
+auto files(Bench& bench) -> void {
+    std::string path = "/tmp/epp-bench-" + std::to_string(getpid());
+
+    struct Case {
+        const char *name;
+        std::vector<std::string> lines;
+    };
+
+    Case cases[] = {
+        {"short", Corpus(2).short_lines(1'000'000)},
+        {"huge", Corpus(3).huge_lines(4, 16'000'000)},
+        {"unicode", Corpus(4).unicode_lines(500'000)},
+        {"tabs", Corpus(5).tab_lines(500'000, 12)},
+    };
+
+    for (auto& c: cases) {
+        std::string name = c.name;
+
+        if (!bench.wanted("load/" + name) && !bench.wanted("save/" + name))
+            continue;
+
+        double megabytes = bytes(c.lines) / 1e6;
+        Editor editor;
+
+        editor.output = path.c_str();
+        editor.assign(c.lines);
+        editor.save();
+
+        auto throughput = [&](double ns) { return std::to_string(static_cast<int>(megabytes / (ns / 1e9))) + " MB/s"; };
+
+        bench.run("load/" + name, 3, [&](int) { editor.load(); }, throughput);
+        bench.run("save/" + name, 3, [&](int) { editor.save(); }, throughput);
+    }
+
+    std::remove(path.c_str());
+}
+
+auto search(Bench& bench) -> void {
+    auto corpus = Corpus(10).huge_lines(1, 16'000'000);
+    std::string_view text = corpus.front();
+    double megabytes = text.size() / 1e6;
+
+    auto throughput = [&](double ns) { return std::to_string(static_cast<int>(megabytes / (ns / 1e9))) + " MB/s"; };
+
+    // needles that never occur, so the whole text is scanned
+    for (std::string_view needle: {"Q", "QZ", "the_", "notinthetexT"}) {
+        std::string name = "search/" + std::to_string(needle.size());
+        std::size_t found = 0;
+
+        bench.run(name + "/find_substring", 20, [&](int i) { found += find_substring(text, needle, i); }, throughput);
+        bench.run(name + "/string_view::find", 20, [&](int i) { found += text.find(needle, i); }, throughput);
+
+        if (bench.wanted(name) && found == 0)
+            std::println("unexpected match");
+    }
+
+    // a whole search over a million lines, on one worker and on all of
+    // them, then a rare word without and with the trigram index
+    if (!bench.wanted("search/scan") && !bench.wanted("search/index"))
+        return;
+
+    auto lines = Corpus(11).short_lines(1'000'000);
+
+    // a word the index can rule out almost every block for
+    for (std::size_t i = 0; i < lines.size(); i += 100'000)
+        lines[i] += "[needle]";
+
+    double size = bytes(lines) / 1e6;
+    auto scanned = [&](double ns) { return std::to_string(static_cast<int>(size / (ns / 1e9))) + " MB/s"; };
+    Editor editor;
+
+    editor.assign(std::move(lines));
+
+    std::vector<std::size_t> counts = {1};
+
+    if (std::thread::hardware_concurrency() > 1)
+        counts.push_back(std::thread::hardware_concurrency());
+
+    for (std::size_t threads: counts) {
+        editor.pool.threads = threads;
+
+        bench.run("search/scan/threads=" + std::to_string(threads), 20, [&](int) {
+            editor.start_search();
+            editor.input('Q');
+        }, scanned);
+    }
+
+    auto rare = [&](int) {
+        editor.start_search();
+        editor.paste("[needle]");
+    };
+
+    bench.run("search/index/none", 20, rare, scanned);
+
+    editor.indexed = true;
+
+    bench.run("search/index/build", 1, [&](int) { editor.reindex(); }, scanned);
+    bench.run("search/index/lookup", 20, rare, [&](double) { return std::to_string(editor.search.matches()) + " lines match"; });
+
+    // a save after an edit: the index takes in the edited line and is
+    // written out next to the file, not built again
+    std::string path = "/tmp/epp-bench-" + std::to_string(getpid());
+    std::string directory = path + ".index";
+
+    std::filesystem::create_directories(directory);
+    editor.output = path.c_str();
+    editor.index_directory = directory;
+    editor.stop_search();
+
+    bench.run("search/index/save", 3, [&](int) {
+        editor.line = 1;
+        editor.column = 0;
+        editor.insert('x');
+        editor.save();
+    }, scanned);
+
+    rare(0);
+
+    if (bench.wanted("search/index/save") && editor.search.matches() != 10)
+        std::println("{} lines match after saving, not 10", editor.search.matches());
+
+    std::remove(path.c_str());
+    std::filesystem::remove_all(directory);
+}
+
+// the built-in engine against std::regex, counting the matching lines of
+// a log; the first epp pass builds the DFA states the later ones reuse
+auto regex(Bench& bench) -> void {
+    if (!bench.wanted("regex/"))
+        return;
+
+    auto lines = Corpus(12).log_lines(400'000);
+    double megabytes = bytes(lines) / 1e6;
+    auto throughput = [&](double ns) { return std::to_string(static_cast<int>(megabytes / (ns / 1e9))) + " MB/s"; };
+
+    std::string_view patterns[] = {
+        "ERROR.*timeout",
+        "from 10\\.0\\.1[0-5]\\.[0-9]+ took 1[0-9][0-9][0-9]ms",
+        "\\[worker-(3|5)\\] request [0-9]*7 ",
+    };
+
+    for (std::size_t k = 0; k < std::size(patterns); ++k) {
+        std::string name = "regex/" + std::to_string(k);
+        std::string pattern(patterns[k]);
+        Regex compiled(pattern);
+        std::regex standard(pattern);
+        std::size_t ours = 0;
+        std::size_t theirs = 0;
+
+        bench.run(name + "/epp", 3, [&](int) {
+            ours = 0;
+
+            for (auto& line: lines)
+                ours += compiled.contains(line);
+        }, throughput);
+
+        bench.run(name + "/std::regex", 1, [&](int) {
+            theirs = 0;
+
+            for (auto& line: lines)
+                theirs += std::regex_search(line, standard);
+        }, throughput);
+
+        if (bench.wanted(name + "/epp") && bench.wanted(name + "/std::regex") && ours != theirs)
+            std::println("{}: {} lines match, std::regex says {}", pattern, ours, theirs);
+    }
+}
+
+// renaming the hosts of a million-line log, back and forth so every pass
+// has the same work, on one worker and on all of them; then undoing and
+// redoing a rename, which rewrites the same lines from the undo record
+auto replace(Bench& bench) -> void {
+    if (!bench.wanted("replace/"))
+        return;
+
+    auto lines = Corpus(13).log_lines(1'000'000);
+    double megabytes = bytes(lines) / 1e6;
+    auto throughput = [&](double ns) { return std::to_string(static_cast<int>(megabytes / (ns / 1e9))) + " MB/s"; };
+    Editor editor;
+
+    editor.assign(std::move(lines));
+
+    auto rename = [&](std::string_view from, std::string_view to) {
+        editor.start_search();
+        editor.paste(from);
+        editor.input(0x14);
+        editor.paste(to);
+        editor.input('\n');
+    };
+
+    std::vector<std::size_t> counts = {1};
+
+    if (std::thread::hardware_concurrency() > 1)
+        counts.push_back(std::thread::hardware_concurrency());
+
+    for (std::size_t threads: counts) {
+        editor.pool.threads = threads;
+
+        bench.run("replace/all/threads=" + std::to_string(threads), 10, [&](int i) {
+            if (i % 2 == 0)
+                rename("from 10.0.", "from db-primary.internal.");
+            else
+                rename("from db-primary.internal.", "from 10.0.");
+        }, throughput);
+    }
+
+    bench.run("replace/undo", 10, [&](int i) { editor.input(i % 2 == 0 ? 'U' : 'R'); }, throughput);
+}
+
+// typing a character and deleting it at many cursors: on a line each, and
+// all on one long line, where every separate insert shifts the rest of it
+// again; "separate" does what the batch replaces, one insert or backspace
+// per cursor from the last one back
+auto cursors(Bench& bench) -> void {
+    struct Case {
+        std::string name;
+        std::vector<std::string> lines;
+        std::vector<std::pair<int, int>> at;
+    };
+
+    std::vector<Case> cases(2);
+
+    cases[0].name = "cursors/lines=10000";
+    cases[0].lines = Corpus(14).short_lines(10'000);
+    cases[1].name = "cursors/one-line/cursors=1000";
+    cases[1].lines = Corpus(15).huge_lines(1, 100'000);
+
+    for (int i = 0; i < 10'000; ++i)
+        cases[0].at.push_back({i, 0});
+
+    for (int i = 0; i < 1'000; ++i)
+        cases[1].at.push_back({0, i * 100});
+
+    for (auto& c: cases) {
+        if (!bench.wanted(c.name))
+            continue;
+
+        Editor editor;
+
+        editor.assign(c.lines);
+        std::tie(editor.line, editor.column) = c.at.front();
+        editor.cursors.assign(c.at.begin() + 1, c.at.end());
+
+        bench.run(c.name + "/batched", 200, [&](int i) { editor.input(i % 2 == 0 ? 'x' : 127); });
+
+        editor.assign(c.lines);
+
+        bench.run(c.name + "/separate", 200, [&](int i) {
+            for (auto it = c.at.rbegin(); it != c.at.rend(); ++it) {
+                editor.line = it->first;
+                editor.column = it->second + i % 2;
+
+                if (i % 2 == 0)
+                    editor.insert('x');
+                else
+                    editor.backspace();
+            }
+        });
+    }
+
+    // pasting lines at the first of many cursors moves the ones below
+    // down with the text, so typing at them afterwards still lands on the
+    // lines they were on
+    if (!bench.wanted("cursors/paste"))
+        return;
+
+    Editor editor;
+
+    editor.assign(Corpus(16).short_lines(10'000));
+
+    for (int i = 1; i < 1'000; ++i)
+        editor.cursors.push_back({i * 10, 5});
+
+    bench.run("cursors/paste", 200, [&](int) {
+        editor.paste("pasted\nlines\n");
+        editor.input('x');
+    });
+
+    for (auto [l, col]: editor.cursors)
+        if (editor.lines[l].compare(col - 200, 200, std::string(200, 'x')) != 0)
+            std::println("cursor at {}:{} left its line", l, col);
+}
+
+auto display(Bench& bench) -> void {
+    struct Case {
+        const char *name;
+        std::vector<std::string> lines;
+        char motion;
+        bool wrap;
+    };
+
+    Case cases[] = {
+        {"short", Corpus(6).short_lines(100'000), 'N', false},
+        {"huge", Corpus(7).huge_lines(200, 1'000'000), 'F', false},
+        {"huge/wrap", Corpus(7).huge_lines(4, 1'000'000), 'N', true},
+        {"unicode", Corpus(8).unicode_lines(100'000), 'N', false},
+        {"tabs", Corpus(9).tab_lines(100'000, 12), 'N', false},
+    };
+
+    for (auto& c: cases) {
+        std::string name = std::string("display/") + c.name;
+
+        if (!bench.wanted(name))
+            continue;
+
+        Editor editor;
+        Tui tui(120, 40);
+        Frame frame;
+
+        editor.wrap = c.wrap;
+        editor.assign(std::move(c.lines));
+
+        int iterations = 20'000;
+        std::size_t before = tui.written;
+
+        auto frame_size = [&](double) { return std::to_string((tui.written - before) / iterations) + " bytes/frame"; };
+
+        bench.run(name, iterations, [&](int) {
+            editor.input(c.motion);
+            compose(editor, tui, frame);
+            draw(tui, frame);
+        }, frame_size);
+    }
+}
+
+auto main(int argc, char *argv[]) -> int {
+    Bench bench{argc > 1 ? argv[1] : ""};
+
+    editing(bench);
+    graphemes(bench);
+    files(bench);
+    search(bench);
+    regex(bench);
+    replace(bench);
+    cursors(bench);
+    display(bench);
+
+    return 0;
+}
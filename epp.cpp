@@ -1,249 +1,574 @@
-#include <string>
-#include <vector>
-#include <span>
-#include <print>
-#include <iostream>
-#include <algorithm>
-#include <fstream>
-#include <iterator>
-#include <termios.h>
-#include <unistd.h>
-#include <sys/ioctl.h>
-
-struct Editor {
-    const char *output = "out";
-    std::vector<std::string> lines = {""};
-    int line = 0;
-    int column = 0;
-    int line_offset = 0;
-    bool running = true;
-
-    auto new_line() -> void {
-        column = 0;
-        lines.insert(lines.begin() + line, "");
-    }
-
-    auto delete_line() -> void {
-        if (lines.size() == 1)
-            return;
+#include "epp.hpp"
+
+#include <thread>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+
+// Input side of the pipeline: one epoll set for stdin, SIGWINCH through
+// a signalfd, timerfd timers, inotify on the edited file's directory and
+// the eventfd search workers write to. It sleeps in epoll_wait whenever
+// nothing happens.
+struct Loop {
+    Queue<Event, 4096>& queue;
+    Tui& tui;
+    int stop;
+    int found;
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    int signals = -1;
+    int escape = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    int settle = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    int notify = inotify_init1(IN_CLOEXEC);
+    int due = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    std::string watched;
+    bool pollable = true;
+    Decoder decoder;
+    std::ifstream replay;
+    bool fast = false;
+    Event next;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::microseconds offset;
+
+    Loop(Queue<Event, 4096>& queue, Tui& tui, int stop, int found, sigset_t const& mask, const char *file)
+        : queue(queue), tui(tui), stop(stop), found(found) {
+        signals = signalfd(-1, &mask, SFD_CLOEXEC);
+
+        std::filesystem::path path = file;
+        auto directory = path.parent_path().empty() ? std::filesystem::path(".") : path.parent_path();
+
+        watched = path.filename();
+        inotify_add_watch(notify, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+
+        for (int fd: {stop, found, signals, escape, settle, notify, due})
+            add(fd);
+    }
+
+    ~Loop() {
+        for (int fd: {epoll, signals, escape, settle, notify, due})
+            close(fd);
+    }
+
+    // feeds a recording instead of the terminal, either with its original
+    // timing or as fast as the editor takes it
+    auto play(const char *path, bool as_fast_as_possible) -> bool {
+        replay.open(path, std::ios::binary);
+
+        std::string header(Recording::magic.size(), 0);
+
+        replay.read(header.data(), header.size());
+        fast = as_fast_as_possible;
+
+        return replay && header == Recording::magic;
+    }
+
+    auto play_next() -> bool {
+        while (Recording::read(replay, next, offset)) {
+            if (!fast && start + offset > std::chrono::steady_clock::now()) {
+                struct itimerspec spec = {};
+                auto when = (start + offset).time_since_epoch();
+
+                spec.it_value.tv_sec = std::chrono::duration_cast<std::chrono::seconds>(when).count();
+                spec.it_value.tv_nsec = (when % std::chrono::seconds{1}).count();
+                timerfd_settime(due, TFD_TIMER_ABSTIME, &spec, nullptr);
+
+                return true;
+            }
+
+            next.time = std::chrono::steady_clock::now();
+            queue.push(std::move(next));
+        }
+
+        return false;
+    }
+
+    auto add(int fd) -> bool {
+        struct epoll_event event = {};
+
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+
+        return epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) == 0;
+    }
 
-        lines.erase(lines.begin() + line);
-        column = 0;
+    auto arm(int timer, std::chrono::milliseconds delay) -> void {
+        struct itimerspec spec = {};
 
-        if (line >= static_cast<int>(lines.size()))
-            --line;
+        spec.it_value.tv_sec = delay.count() / 1000;
+        spec.it_value.tv_nsec = delay.count() % 1000 * 1'000'000;
+        timerfd_settime(timer, 0, &spec, nullptr);
     }
 
-    auto backspace() -> void {
-        if (column == 0)
+    auto expire(int timer) -> void {
+        std::uint64_t count;
+
+        if (read(timer, &count, sizeof(count)) != sizeof(count))
             return;
+    }
+
+    auto run() -> void {
+        std::array<char, 65536> chunk;
+        std::array<struct epoll_event, 8> events;
+        auto push = [&](Event&& event) { queue.push(std::move(event)); };
+
+        if (replay.is_open()) {
+            start = std::chrono::steady_clock::now();
+
+            if (!play_next())
+                return finish();
+        } else {
+            pollable = add(STDIN_FILENO);
+            // keys typed while the terminal was being queried
+            decoder.feed(std::exchange(tui.typeahead, {}), push);
+
+            if (!decoder.pending.empty())
+                arm(escape, std::chrono::milliseconds{25});
+        }
+
+        // regular files can't be polled, so scripted input is read up front
+        while (!pollable) {
+            ssize_t n = read(STDIN_FILENO, chunk.data(), chunk.size());
+
+            if (n <= 0)
+                return finish();
+
+            decoder.feed(std::string_view(chunk.data(), n), push);
+        }
 
-        --column;
-        lines[line].erase(column, 1);
+        while (true) {
+            int ready = epoll_wait(epoll, events.data(), events.size(), -1);
+
+            if (ready < 0 && errno == EINTR)
+                continue;
+
+            if (ready < 0)
+                break;
+
+            for (auto& event: std::span(events).first(ready)) {
+                int fd = event.data.fd;
+
+                if (fd == stop)
+                    return finish();
+
+                if (fd == STDIN_FILENO) {
+                    ssize_t n = read(STDIN_FILENO, chunk.data(), chunk.size());
+
+                    if (n <= 0)
+                        return finish();
+
+                    decoder.feed(std::string_view(chunk.data(), n), push);
+
+                    if (!decoder.pending.empty())
+                        arm(escape, std::chrono::milliseconds{25});
+                } else if (fd == escape) {
+                    expire(escape);
+                    decoder.flush(push);
+                } else if (fd == signals) {
+                    struct signalfd_siginfo info;
+
+                    if (read(signals, &info, sizeof(info)) != sizeof(info))
+                        continue;
+
+                    if (info.ssi_signo == SIGWINCH) {
+                        tui.resize();
+                        queue.push(Event{Event::resize});
+                    } else if (info.ssi_signo == SIGUSR1) {
+                        queue.push(Event{Event::stats});
+                    }
+                } else if (fd == notify) {
+                    alignas(struct inotify_event) std::array<char, 4096> buffer;
+                    ssize_t n = read(notify, buffer.data(), buffer.size());
+
+                    for (ssize_t offset = 0; offset < n;) {
+                        auto *change = reinterpret_cast<struct inotify_event *>(buffer.data() + offset);
+
+                        // writers often save in several steps; settle first
+                        if (change->len > 0 && watched == change->name)
+                            arm(settle, std::chrono::milliseconds{100});
+
+                        offset += sizeof(struct inotify_event) + change->len;
+                    }
+                } else if (fd == due) {
+                    expire(due);
+                    next.time = std::chrono::steady_clock::now();
+                    queue.push(std::move(next));
+
+                    if (!play_next())
+                        return finish();
+                } else if (fd == found) {
+                    eventfd_t count;
+
+                    // however many blocks finished, one event picks them up
+                    if (eventfd_read(found, &count) == 0)
+                        queue.push(Event{Event::found});
+                } else if (fd == settle) {
+                    expire(settle);
+                    queue.push(Event{Event::changed});
+                }
+            }
+        }
+
+        finish();
     }
 
-    auto insert(char c, int count = 1) -> void {
-        lines[line].insert(column, count, c);
-        column += count;
+    auto finish() -> void {
+        decoder.flush([&](Event&& event) { queue.push(std::move(event)); });
+        queue.push(Event{Event::closed});
     }
+};
 
-    auto load() -> void {
-        lines.clear();
+auto render(Tui& tui, Frames& frames, std::atomic<bool>& done, Latency *latency) -> void {
+    while (true) {
+        auto& frame = frames.latest();
 
-        std::ifstream f{output};
+        if (done.load())
+            return;
 
-        std::string file_line;
+        draw(tui, frame);
 
-        while (std::getline(f, file_line))
-            lines.push_back(file_line);
+        if (latency)
+            latency->settle(frame.sequence);
     }
+}
+
+// EPP_LATENCY names the file the keystroke latency histogram is written
+// to on exit, or - for stderr
+auto report(Latency const& latency, const char *path) -> void {
+    if (std::string_view(path) == "-")
+        return latency.report(stderr);
 
-    auto save() -> void {
-        std::ofstream f{output};
-        std::ranges::copy(lines, std::ostream_iterator<std::string>(f, "\n"));
+    if (std::FILE *out = std::fopen(path, "w")) {
+        latency.report(out);
+        std::fclose(out);
     }
+}
 
-    auto move(char c) -> void {
-        switch (c) {
-        case 'B':
-            column = std::max(0, column - 1);
-            break;
-        case 'F':
-            column = std::min(static_cast<int>(lines[line].size()), column + 1);
-            break;
-        case 'N':
-            line = std::min(static_cast<int>(lines.size() - 1), line + 1);
-            column = std::min(static_cast<int>(lines[line].size()), column);
-            break;
-        case 'P':
-            line = std::max(0, line - 1);
-            column = std::min(static_cast<int>(lines[line].size()), column);
-            break;
-        case 'A':
-            column = 0;
-            break;
-        case 'E':
-            column = lines[line].size();
-            break;
-        case 'V':
-            line = std::min(static_cast<int>(lines.size() - 1), line + 10);
-            column = std::min(static_cast<int>(lines[line].size()), column);
-            break;
-        case 'C':
-            line = std::max(0, line - 10);
-            column = std::min(static_cast<int>(lines[line].size()), column);
-            break;
-        case 'Q':
-            running = false;
-            break;
+// Written on SIGUSR1 to EPP_STATS, or /tmp/epp-PID.stats. The editor
+// thread gathers it between events, so the editor's state is consistent;
+// the renderer's side comes from counters it keeps anyway.
+auto dump_stats(Editor const& editor, Tui const& tui, const char *path) -> void {
+    // heap bytes behind a string, beyond its small-string buffer
+    auto heap = [](std::string const& s) { return s.capacity() > std::string().capacity() ? s.capacity() + 1 : 0; };
+    auto ms = [](std::chrono::nanoseconds d) { return std::chrono::duration<double, std::milli>(d).count(); };
+
+    std::size_t bytes = 0;
+    std::size_t storage = 0;
+
+    // leaves, counted as if full, plus the lines' own buffers
+    for (std::size_t i = 0; i < editor.lines.size();) {
+        auto leaf = editor.lines.chunk(i);
+
+        storage += sizeof(Lines::Node) + Lines::fanout * sizeof(Lines::Line);
+
+        for (auto& line: leaf) {
+            bytes += line.text.size() + 1;
+            storage += heap(line.text);
+            ++i;
         }
     }
 
-    auto input(char c) -> void {
-        switch (c) {
-        case '\n':
-            ++line;
-            new_line();
+    std::size_t caches = 0;
+
+    for (auto& [version, entry]: editor.columns.cache)
+        caches += sizeof(entry) + entry.marks.capacity() * sizeof(entry.marks[0]);
+
+    for (auto& [version, points]: editor.layout.cache)
+        caches += sizeof(points) + points.capacity() * sizeof(int);
+
+    caches += editor.layout.rows.memory() + editor.layout.pending.capacity() * sizeof(int);
+
+    std::string file = path ? path : "/tmp/epp-" + std::to_string(getpid()) + ".stats";
+    std::FILE *out = std::fopen(file.c_str(), "w");
+
+    if (!out)
+        return;
+
+    std::println(out, "lines            {}", editor.lines.size());
+    std::println(out, "bytes            {}", bytes);
+    std::println(out, "memory.lines     {}", storage);
+    std::println(out, "memory.caches    {}", caches);
+    std::println(out, "memory.render    {}", tui.held.load(std::memory_order_relaxed));
+    std::println(out, "memory.undo      {}", editor.history.log.capacity());
+    std::println(out, "undo.log         {}", editor.history.end);
+    std::println(out, "frames           {}", tui.frames.load(std::memory_order_relaxed));
+    std::println(out, "written.bytes    {}", tui.written.load(std::memory_order_relaxed));
+    std::println(out, "written.calls    {}", tui.writes.load(std::memory_order_relaxed));
+    std::println(out, "time.load_ms     {:.3f}", ms(editor.loading));
+    std::println(out, "time.save_ms     {:.3f}", ms(editor.saving));
+    std::println(out, "time.display_ms  {:.3f}", ms(std::chrono::nanoseconds{tui.drawing.load(std::memory_order_relaxed)}));
+
+    std::fclose(out);
+}
+
+// Runs the editor on the calling thread against an in-memory screen,
+// reading keys from stdin or events from a recording, and recording them
+// in turn if asked, then prints the final screen and where the time went.
+auto headless(Editor& editor, Tui& tui, const char *replay, std::ofstream& recording, Latency *latency) -> int {
+    using clock = std::chrono::steady_clock;
+
+    Frame frame;
+    std::size_t events = 0;
+    clock::duration editing{};
+    clock::duration rendering{};
+    auto session = clock::now();
+
+    auto step = [&](Event const& event) {
+        if (!editor.running)
+            return;
+
+        auto start = clock::now();
+        bool searching = editor.search.active;
+
+        apply(editor, event);
+
+        if (recording.is_open())
+            Recording::write(recording, event, session);
+
+        auto applied = clock::now();
+
+        compose(editor, tui, frame);
+        draw(tui, frame);
+
+        if (latency) {
+            latency->sample(event, searching, frame.sequence);
+            latency->settle(frame.sequence);
+        }
+
+        editing += applied - start;
+        rendering += clock::now() - applied;
+        ++events;
+    };
+
+    compose(editor, tui, frame);
+    draw(tui, frame);
+
+    std::size_t initial = tui.written;
+
+    if (replay) {
+        std::ifstream in{replay, std::ios::binary};
+        std::string header(Recording::magic.size(), 0);
+
+        in.read(header.data(), header.size());
+
+        if (header != Recording::magic) {
+            std::println(stderr, "{}: not a recording", replay);
+            return 1;
+        }
+
+        Event event;
+        std::chrono::microseconds offset;
+
+        while (Recording::read(in, event, offset))
+            step(event);
+    } else {
+        Decoder decoder;
+        std::array<char, 65536> chunk;
+        ssize_t n;
+
+        while ((n = read(STDIN_FILENO, chunk.data(), chunk.size())) > 0)
+            decoder.feed(std::string_view(chunk.data(), n), step);
+
+        decoder.flush(step);
+    }
+
+    auto ms = [](clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); };
+
+    std::print("{}", tui.screen->dump());
+    std::println(stderr, "{} events, edit {:.3f} ms, render {:.3f} ms, {} bytes", events, ms(editing), ms(rendering), tui.written - initial);
+
+    return 0;
+}
+
+auto main(int argc, char *argv[]) -> int {
+    Editor editor;
+
+    const char *record = nullptr;
+    const char *replay = nullptr;
+    bool fast = false;
+    bool no_terminal = false;
+    int columns = 80;
+    int rows = 24;
+    int option;
+
+    while ((option = getopt(argc, argv, "wit:r:p:fHg:")) != -1) {
+        switch (option) {
+        case 'w':
+            editor.wrap = true;
             break;
-        case 'O':
-            new_line();
+        case 'i':
+            editor.indexed = true;
             break;
-        case '\b':
-        case 127:
-            backspace();
+        case 't':
+            editor.set_tab_width(std::max(1, std::atoi(optarg)));
             break;
-        case '\t':
-            insert(' ', 4);
+        case 'r':
+            record = optarg;
             break;
-        case 'K':
-            delete_line();
+        case 'p':
+            replay = optarg;
             break;
-        case 'S':
-            save();
+        case 'f':
+            fast = true;
             break;
-        default:
-            if (std::string{"BFNPAECVQ"}.contains(c))
-                move(c);
-            else
-                insert(c);
+        case 'H':
+            no_terminal = true;
             break;
+        case 'g':
+            if (std::sscanf(optarg, "%dx%d", &columns, &rows) != 2 || columns < 2 || rows < 2) {
+                std::println(stderr, "{}: geometry must be COLUMNSxROWS", optarg);
+                return 1;
+            }
+            break;
+        default:
+            std::println(stderr, "usage: {} [-w] [-i] [-t tab_width] [-r recording | -p recording [-f]] [-H [-g COLUMNSxROWS]] [file]", argv[0]);
+            return 1;
         }
     }
 
-    auto adjust_offset(int height) -> void {
-        int line_count = line + 1;
+    std::ofstream recording;
 
-        if (line_count - line_offset > height)
-            line_offset = line_count - height;
-        else if (line - line_offset < 0)
-            line_offset = line;
+    if (record) {
+        recording.open(record, std::ios::binary);
+        recording << Recording::magic;
     }
-};
 
-struct Tui {
-    struct termios term;
-    std::vector<std::string> back_buffer;
+    // undo histories and search indexes persist under the XDG state
+    // directory
+    std::string state;
 
-    Tui() {
-        tcgetattr(STDIN_FILENO, &term);
-        term.c_lflag &= ~(ECHO | ICANON);
-        tcsetattr(STDIN_FILENO, TCSANOW, &term);
-    }
+    if (auto *xdg = std::getenv("XDG_STATE_HOME"))
+        state = std::string(xdg) + "/epp";
+    else if (auto *home = std::getenv("HOME"))
+        state = std::string(home) + "/.local/state/epp";
 
-    ~Tui() {
-        tcgetattr(STDIN_FILENO, &term);
-        term.c_lflag |= (ECHO | ICANON);
-        tcsetattr(STDIN_FILENO, TCSANOW, &term);
+    if (!state.empty()) {
+        editor.undo_directory = state + "/undo";
+        editor.index_directory = state + "/index";
     }
 
-    auto move_cursor(int x, int y) -> void {
-        std::print("\033[{};{}H", y, x);
-    }
+    for (auto *directory: {&editor.undo_directory, &editor.index_directory}) {
+        std::error_code error;
 
-    auto width() -> int {
-        struct winsize w;
-        ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+        if (!directory->empty())
+            std::filesystem::create_directories(*directory, error);
 
-        return w.ws_col - 1;
+        if (error)
+            directory->clear();
     }
 
-    auto height() -> int {
-        struct winsize w;
-        ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+    // background work reports through this; headless runs and replays
+    // wait for it, so a search ends up in the same place on every run
+    if (!no_terminal && !replay)
+        editor.wake = eventfd(0, EFD_CLOEXEC);
 
-        return w.ws_row - 1;
+    if (optind < argc) {
+        editor.output = argv[optind];
+        editor.load();
     }
 
-    auto display(std::vector<std::string> const& lines, int offset = 0) -> void {
-        move_cursor(1, 1);
+    const char *latency_report = std::getenv("EPP_LATENCY");
+    std::optional<Latency> latency;
 
-        int count = std::min(height(), static_cast<int>(lines.size() - offset));
+    if (latency_report)
+        latency.emplace();
 
-        for (int i = 0; i < count; ++i) {
-            auto& line = lines[offset + i];
+    if (no_terminal) {
+        Tui tui(columns, rows);
+        int status = headless(editor, tui, replay, recording, latency ? &*latency : nullptr);
 
-            std::print("{}", line);
+        if (latency)
+            report(*latency, latency_report);
 
-            if (i < static_cast<int>(back_buffer.size())) {
-                auto& back_buffer_line = back_buffer[i];
-
-                if (line.size() < back_buffer_line.size()) {
-                    std::string blank;
+        return status;
+    }
 
-                    blank.insert(0, back_buffer_line.size() - line.size(), ' ');
+    sigset_t mask;
 
-                    std::print("{}", blank);
-                }
-            }
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, nullptr);
 
-            std::println("");
-        }
-    }
+    Tui tui;
+    Queue<Event, 4096> queue;
+    Frames frames;
+    std::atomic<bool> done = false;
+    int stop[2];
 
-    auto setup_back_buffer(std::vector<std::string> const& lines, int offset = 0) -> void {
-        back_buffer.clear();
+    if (pipe(stop) != 0)
+        return 1;
 
-        int count = std::min(height(), static_cast<int>(lines.size() - offset));
+    Loop loop(queue, tui, stop[0], editor.wake, mask, editor.output);
 
-        for (auto& line: std::span(lines).subspan(offset, count)) {
-            back_buffer.push_back(line);
-        }
+    if (replay && !loop.play(replay, fast)) {
+        std::println(stderr, "{}: not a recording", replay);
+        return 1;
     }
-};
 
-auto main(int argc, char *argv[]) -> int {
-    Editor editor;
-    Tui tui;
+    auto start = std::chrono::steady_clock::now();
+    std::uint64_t sequence = 0;
 
-    if (argc > 1) {
-        editor.output = argv[1];
-        editor.load();
-    }
+    auto publish = [&] {
+        auto& frame = frames.draft();
 
-    std::streambuf *buf = std::cin.rdbuf();
+        compose(editor, tui, frame);
+        frame.sequence = ++sequence;
+        frames.publish();
+    };
 
-    tui.display(editor.lines, editor.line_offset);
-    tui.setup_back_buffer(editor.lines);
-    tui.move_cursor(editor.column + 1, editor.line - editor.line_offset + 1);
+    std::jthread renderer(render, std::ref(tui), std::ref(frames), std::ref(done), latency ? &*latency : nullptr);
+    std::jthread reader([&] { loop.run(); });
+
+    publish();
+
+    bool closed = false;
+    Event event;
 
     while (editor.running) {
-        char input = buf->sbumpc();
+        queue.wait();
+
+        while (editor.running && queue.pop(event)) {
+            closed = event.kind == Event::closed;
+
+            bool searching = editor.search.active;
 
-        editor.input(input);
+            apply(editor, event);
+
+            if (event.kind == Event::stats)
+                dump_stats(editor, tui, std::getenv("EPP_STATS"));
+
+            if (latency)
+                latency->sample(event, searching, sequence + 1);
+
+            if (recording.is_open() && (event.kind == Event::key || event.kind == Event::paste))
+                Recording::write(recording, event, start);
+        }
+
+        if (recording.is_open())
+            recording.flush();
+
+        publish();
+    }
 
-        editor.adjust_offset(tui.height());
+    done = true;
+    frames.publish();
+    renderer.join();
 
-        // 1-index based
-        int visual_line = editor.line - editor.line_offset + 1;
-        int visual_column = editor.column + 1;
+    if (latency)
+        report(*latency, latency_report);
 
-        tui.display(editor.lines, editor.line_offset);
+    // wake the reader and drain the queue so it can't block on a full one
+    char byte = 0;
 
-        tui.move_cursor(visual_column, visual_line);
+    if (write(stop[1], &byte, 1) != 1)
+        return 1;
 
-        std::cout.flush();
+    while (!closed) {
+        queue.wait();
 
-        tui.setup_back_buffer(editor.lines, editor.line_offset);
+        while (queue.pop(event))
+            closed = closed || event.kind == Event::closed;
     }
 
     return 0;
@@ -0,0 +1,5239 @@
+#pragma once
+
+#include <string>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <span>
+#include <print>
+#include <iostream>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <chrono>
+#include <string_view>
+#include <cstdint>
+#include <utility>
+#include <unordered_map>
+#include <array>
+#include <atomic>
+#include <optional>
+#include <charconv>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <termios.h>
+#include <unistd.h>
+#include <poll.h>
+#include <cerrno>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <memory>
+#include <map>
+#include <bitset>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <sys/eventfd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+#if defined(EPP_TRACE)
+// Chrome trace events for builds with -DEPP_TRACE: each thread appends
+// complete ("X") spans to its own buffer, and the buffers are written as
+// one JSON file at exit, to EPP_TRACE_FILE or /tmp/epp-PID.trace.json.
+// Open it in Perfetto or chrome://tracing.
+struct Trace {
+    struct Span {
+        const char *name;
+        std::int64_t begin;
+        std::int64_t end;
+    };
+
+    struct Thread {
+        int id;
+        std::vector<Span> spans;
+    };
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Thread>> threads;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    auto local() -> Thread& {
+        thread_local Thread *thread = [&] {
+            std::lock_guard lock(mutex);
+
+            threads.push_back(std::make_unique<Thread>(static_cast<int>(threads.size()) + 1));
+
+            return threads.back().get();
+        }();
+
+        return *thread;
+    }
+
+    auto now() -> std::int64_t {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // every other thread has been joined by the time statics are destroyed
+    ~Trace() {
+        auto *variable = std::getenv("EPP_TRACE_FILE");
+        std::string path = variable ? variable : "/tmp/epp-" + std::to_string(getpid()) + ".trace.json";
+        std::FILE *out = std::fopen(path.c_str(), "w");
+
+        if (!out)
+            return;
+
+        std::print(out, "{{\"traceEvents\":[");
+
+        const char *separator = "";
+
+        for (auto& thread: threads) {
+            for (auto& span: thread->spans) {
+                std::print(out, "{}\n{{\"name\":\"{}\",\"ph\":\"X\",\"pid\":1,\"tid\":{},\"ts\":{:.3f},\"dur\":{:.3f}}}",
+                    separator, span.name, thread->id, span.begin / 1e3, (span.end - span.begin) / 1e3);
+                separator = ",";
+            }
+        }
+
+        std::println(out, "\n]}}");
+        std::fclose(out);
+    }
+};
+
+inline Trace trace;
+
+struct Traced {
+    const char *name;
+    std::int64_t begin = trace.now();
+
+    explicit Traced(const char *name) : name(name) {}
+
+    ~Traced() {
+        trace.local().spans.push_back({name, begin, trace.now()});
+    }
+};
+
+#define EPP_TRACE_JOIN(a, b) a##b
+#define EPP_TRACE_NAME(line) EPP_TRACE_JOIN(traced_, line)
+#define TRACE(name) Traced EPP_TRACE_NAME(__LINE__){name}
+#else
+#define TRACE(name)
+#endif
+
+struct Range {
+    char32_t first;
+    char32_t last;
+};
+
+constexpr Range zero_width[] = {
+    {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF}, {0x05C1, 0x05C2},
+    {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A}, {0x064B, 0x065F}, {0x0670, 0x0670},
+    {0x06D6, 0x06DC}, {0x06DF, 0x06E4}, {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0900, 0x0903},
+    {0x093A, 0x093C}, {0x093E, 0x094F}, {0x0951, 0x0957}, {0x0962, 0x0963}, {0x0E31, 0x0E31},
+    {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF}, {0x200B, 0x200F},
+    {0x2060, 0x2064}, {0x20D0, 0x20FF}, {0x302A, 0x302F}, {0x3099, 0x309A}, {0xFE00, 0xFE0F},
+    {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF}, {0x1F3FB, 0x1F3FF}, {0xE0000, 0xE0FFF},
+};
+
+constexpr Range double_width[] = {
+    {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC}, {0x23F0, 0x23F0},
+    {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267F, 0x267F},
+    {0x2693, 0x2693}, {0x26A1, 0x26A1}, {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5},
+    {0x26CE, 0x26CE}, {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+    {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B}, {0x2728, 0x2728},
+    {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+    {0x27B0, 0x27B0}, {0x27BF, 0x27BF}, {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55},
+    {0x2E80, 0x303E}, {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+    {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19}, {0xFE30, 0xFE6F},
+    {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4}, {0x17000, 0x18CFF}, {0x1B000, 0x1B2FF},
+    {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F251},
+    {0x1F300, 0x1F64F}, {0x1F680, 0x1F6FF}, {0x1F7E0, 0x1F7EB}, {0x1F90C, 0x1F9FF}, {0x1FA70, 0x1FAFF},
+    {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD},
+};
+
+inline auto in_ranges(std::span<Range const> ranges, char32_t c) -> bool {
+    auto it = std::upper_bound(ranges.begin(), ranges.end(), c, [](char32_t c, Range const& r) { return c < r.first; });
+
+    return it != ranges.begin() && c <= std::prev(it)->last;
+}
+
+// ASCII without tabs, where every byte is one cell
+inline auto is_plain(std::string_view s) -> bool {
+    std::size_t i = 0;
+
+#if defined(__SSE2__)
+    __m128i tabs = _mm_set1_epi8('\t');
+    auto special = [&](__m128i chunk) { return _mm_or_si128(chunk, _mm_cmpeq_epi8(chunk, tabs)); };
+
+    for (; i + 64 <= s.size(); i += 64) {
+        auto p = reinterpret_cast<__m128i const *>(s.data() + i);
+        __m128i bits = _mm_or_si128(_mm_or_si128(special(_mm_loadu_si128(p)), special(_mm_loadu_si128(p + 1))),
+                                    _mm_or_si128(special(_mm_loadu_si128(p + 2)), special(_mm_loadu_si128(p + 3))));
+
+        if (_mm_movemask_epi8(bits))
+            return false;
+    }
+
+    for (; i + 16 <= s.size(); i += 16) {
+        if (_mm_movemask_epi8(special(_mm_loadu_si128(reinterpret_cast<__m128i const *>(s.data() + i)))))
+            return false;
+    }
+#endif
+
+    for (; i < s.size(); ++i) {
+        if (static_cast<unsigned char>(s[i]) >= 0x80 || s[i] == '\t')
+            return false;
+    }
+
+    return true;
+}
+
+// offset of `needle` in `haystack` at or after `from`, or npos. With SSE2
+// sixteen start positions are tested at a time against the needle's
+// first and last bytes, and only those passing both are compared in full.
+// Needles of one or two bytes go to string_view::find, whose memchr on
+// the first byte is faster than the filter there.
+inline auto find_substring(std::string_view haystack, std::string_view needle, std::size_t from = 0) -> std::size_t {
+    std::size_t m = needle.size();
+
+    if (m > haystack.size() || from > haystack.size() - m)
+        return std::string_view::npos;
+
+#if defined(__SSE2__)
+    if (m > 2) {
+        __m128i first = _mm_set1_epi8(needle.front());
+        __m128i last = _mm_set1_epi8(needle.back());
+        std::size_t end = haystack.size() - m + 1;
+
+        for (; from + 16 <= end; from += 16) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<__m128i const *>(haystack.data() + from));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<__m128i const *>(haystack.data() + from + m - 1));
+            unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+            for (; mask != 0; mask &= mask - 1) {
+                std::size_t at = from + std::countr_zero(mask);
+
+                if (std::memcmp(haystack.data() + at + 1, needle.data() + 1, m - 2) == 0)
+                    return at;
+            }
+        }
+    }
+#endif
+
+    return haystack.find(needle, from);
+}
+
+// decodes the code point at `i` and advances past it; malformed bytes
+// decode as U+FFFD one byte at a time
+inline auto decode(std::string_view s, int& i) -> char32_t {
+    auto byte = [&](int k) { return static_cast<unsigned char>(s[k]); };
+    unsigned char lead = byte(i);
+    int length = lead < 0x80 ? 1 : lead < 0xC2 ? 0 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3 : lead < 0xF5 ? 4 : 0;
+
+    if (length == 1)
+        return s[i++];
+
+    if (length == 0 || i + length > static_cast<int>(s.size())) {
+        ++i;
+        return 0xFFFD;
+    }
+
+    char32_t c = lead & (0x7F >> length);
+
+    for (int k = 1; k < length; ++k) {
+        if ((byte(i + k) & 0xC0) != 0x80) {
+            ++i;
+            return 0xFFFD;
+        }
+
+        c = (c << 6) | (byte(i + k) & 0x3F);
+    }
+
+    i += length;
+
+    return c;
+}
+
+inline auto codepoint_width(char32_t c) -> int {
+    if (c < 0x300)
+        return 1;
+
+    if (in_ranges(zero_width, c))
+        return 0;
+
+    return in_ranges(double_width, c) ? 2 : 1;
+}
+
+inline auto is_extender(char32_t c) -> bool {
+    return c == 0x200D || (c >= 0x300 && in_ranges(zero_width, c));
+}
+
+// end of the grapheme cluster starting at `i`: a base code point with
+// its combining marks, variation selectors and ZWJ sequences
+inline auto next_grapheme(std::string_view s, int i) -> int {
+    int size = s.size();
+
+    if (i >= size)
+        return size;
+
+    if (static_cast<unsigned char>(s[i]) < 0x80 && (i + 1 == size || static_cast<unsigned char>(s[i + 1]) < 0x80))
+        return i + 1;
+
+    char32_t base = decode(s, i);
+    bool joined = false;
+
+    while (i < size) {
+        int next = i;
+        char32_t c = decode(s, next);
+
+        bool regional = base >= 0x1F1E6 && base <= 0x1F1FF && c >= 0x1F1E6 && c <= 0x1F1FF;
+
+        if (!joined && !is_extender(c) && !regional)
+            break;
+
+        joined = c == 0x200D;
+        base = regional ? 0 : base;
+        i = next;
+    }
+
+    return i;
+}
+
+inline auto previous_codepoint(std::string_view s, int i) -> int {
+    int start = std::max(0, i - 4);
+
+    do
+        --i;
+    while (i > start && (static_cast<unsigned char>(s[i]) & 0xC0) == 0x80);
+
+    return i;
+}
+
+// start of the grapheme cluster ending at `i`
+inline auto previous_grapheme(std::string_view s, int i) -> int {
+    if (i <= 0)
+        return 0;
+
+    if (static_cast<unsigned char>(s[i - 1]) < 0x80)
+        return i - 1;
+
+    int start = previous_codepoint(s, i);
+
+    while (start > 0) {
+        int k = start;
+        int before = previous_codepoint(s, start);
+        int b = before;
+
+        if (is_extender(decode(s, k)) || decode(s, b) == 0x200D)
+            start = before;
+        else
+            break;
+    }
+
+    // regional indicators pair up from the start of their run, so the one
+    // at `start` ends a flag when an odd number of them come before it
+    auto regional = [&](int at) {
+        char32_t c = decode(s, at);
+
+        return c >= 0x1F1E6 && c <= 0x1F1FF;
+    };
+
+    if (regional(start)) {
+        int run = 0;
+
+        for (int k = start; k > 0 && regional(previous_codepoint(s, k)); k = previous_codepoint(s, k))
+            ++run;
+
+        if (run % 2 == 1)
+            start = previous_codepoint(s, start);
+    }
+
+    // a scan forward from the found start settles any overshoot
+    while (next_grapheme(s, start) < i)
+        start = next_grapheme(s, start);
+
+    return start;
+}
+
+// cells taken by the grapheme at byte `i` when it starts at cell `cell`
+inline auto cell_width(std::string_view s, int i, int cell, int tab) -> int {
+    if (s[i] == '\t')
+        return tab - cell % tab;
+
+    if (static_cast<unsigned char>(s[i]) < 0x80)
+        return 1;
+
+    return codepoint_width(decode(s, i));
+}
+
+inline auto measure(std::string_view s, int tab = 8) -> int {
+    if (is_plain(s))
+        return s.size();
+
+    int cells = 0;
+
+    for (int i = 0; i < static_cast<int>(s.size()); i = next_grapheme(s, i))
+        cells += cell_width(s, i, cells, tab);
+
+    return cells;
+}
+
+// appends cells [first, last) of `text`, whose byte `i` starts at cell
+// `cell`, with tabs expanded and partly visible wide characters blanked
+inline auto expand(std::string_view text, int i, int cell, int first, int last, int tab, std::string& out) -> void {
+    while (i < static_cast<int>(text.size()) && cell < last) {
+        int next = next_grapheme(text, i);
+        int w = cell_width(text, i, cell, tab);
+
+        if (text[i] == '\t' || cell < first || cell + w > last)
+            out.append(std::max(0, std::min(cell + w, last) - std::max(cell, first)), ' ');
+        else
+            out.append(text.substr(i, next - i));
+
+        cell += w;
+        i = next;
+    }
+}
+
+// Line storage as a persistent B-tree: leaves hold up to `fanout` lines
+// with their versions, inner nodes up to `fanout` children. Copying a
+// Lines is O(1) and shares every node, which makes it a snapshot; a
+// mutation copies only the shared nodes on its path, so snapshots never
+// see it and, with none alive, editing works in place.
+struct Lines {
+    struct Line {
+        std::string text;
+        std::uint64_t version = 0;
+    };
+
+    struct Node {
+        std::size_t size = 0;
+        std::vector<Line> lines;
+        std::vector<std::shared_ptr<Node>> children;
+
+        auto leaf() const -> bool {
+            return children.empty();
+        }
+
+        auto entries() const -> std::size_t {
+            return leaf() ? lines.size() : children.size();
+        }
+    };
+
+    static constexpr std::size_t fanout = 64;
+
+    std::shared_ptr<Node> root = std::make_shared<Node>(Node{1, {Line{}}, {}});
+
+    auto size() const -> std::size_t {
+        return root->size;
+    }
+
+    // the child holding line `index`, which becomes an index into it; one
+    // past the end goes to the last child
+    static auto locate(Node const& node, std::size_t& index) -> std::size_t {
+        std::size_t k = 0;
+
+        for (; k + 1 < node.children.size() && index >= node.children[k]->size; ++k)
+            index -= node.children[k]->size;
+
+        return k;
+    }
+
+    // unshares `node` before writing to it. use_count() is a relaxed
+    // load, so when a snapshot on another thread was the last to let go,
+    // the fence orders that thread's reads before the writes that follow.
+    static auto own(std::shared_ptr<Node>& node) -> Node& {
+        if (node.use_count() > 1)
+            node = std::make_shared<Node>(*node);
+        else
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+        return *node;
+    }
+
+    auto at(std::size_t index) const -> Line const& {
+        Node const *node = root.get();
+
+        while (!node->leaf())
+            node = node->children[locate(*node, index)].get();
+
+        return node->lines[index];
+    }
+
+    auto operator[](std::size_t index) const -> std::string const& {
+        return at(index).text;
+    }
+
+    auto version(std::size_t index) const -> std::uint64_t {
+        return at(index).version;
+    }
+
+    // the rest of the leaf from line `index` on, for walking runs of lines
+    auto chunk(std::size_t index) const -> std::span<Line const> {
+        Node const *node = root.get();
+
+        while (!node->leaf())
+            node = node->children[locate(*node, index)].get();
+
+        return std::span(node->lines).subspan(index);
+    }
+
+    // writable line, unshared first
+    auto line(std::size_t index) -> Line& {
+        Node *node = &own(root);
+
+        while (!node->leaf())
+            node = &own(node->children[locate(*node, index)]);
+
+        return node->lines[index];
+    }
+
+    auto text(std::size_t index) -> std::string& {
+        return line(index).text;
+    }
+
+    // splits an overfull node evenly, keeping the first part in place and
+    // returning the rest, which go right after it in its parent
+    static auto split(Node& node) -> std::vector<std::shared_ptr<Node>> {
+        std::vector<std::shared_ptr<Node>> rest;
+        std::size_t total = node.entries();
+
+        if (total <= fanout)
+            return rest;
+
+        std::size_t parts = (total + fanout - 1) / fanout;
+        std::size_t keep = total / parts + (total % parts > 0);
+
+        for (std::size_t start = keep, part = 1; part < parts; ++part) {
+            std::size_t count = total / parts + (total % parts > part);
+            auto next = std::make_shared<Node>();
+
+            if (node.leaf()) {
+                next->lines.assign(std::make_move_iterator(node.lines.begin() + start), std::make_move_iterator(node.lines.begin() + start + count));
+                next->size = count;
+            } else {
+                next->children.assign(node.children.begin() + start, node.children.begin() + start + count);
+
+                for (auto& child: next->children)
+                    next->size += child->size;
+            }
+
+            rest.push_back(std::move(next));
+            start += count;
+        }
+
+        for (auto& next: rest)
+            node.size -= next->size;
+
+        if (node.leaf())
+            node.lines.resize(keep);
+        else
+            node.children.resize(keep);
+
+        return rest;
+    }
+
+    static auto insert(std::shared_ptr<Node>& node, std::size_t index, std::span<Line> added) -> std::vector<std::shared_ptr<Node>> {
+        Node& n = own(node);
+
+        n.size += added.size();
+
+        if (n.leaf()) {
+            n.lines.insert(n.lines.begin() + index, std::make_move_iterator(added.begin()), std::make_move_iterator(added.end()));
+            return split(n);
+        }
+
+        std::size_t k = locate(n, index);
+        auto rest = insert(n.children[k], index, added);
+
+        n.children.insert(n.children.begin() + k + 1, rest.begin(), rest.end());
+
+        return split(n);
+    }
+
+    // inserts `added` before line `index`, in one pass however many there are
+    auto insert(std::size_t index, std::span<Line> added) -> void {
+        auto rest = insert(root, index, added);
+
+        while (!rest.empty()) {
+            auto top = std::make_shared<Node>();
+
+            top->children.push_back(std::move(root));
+            top->children.insert(top->children.end(), rest.begin(), rest.end());
+
+            for (auto& child: top->children)
+                top->size += child->size;
+
+            root = std::move(top);
+            rest = split(*root);
+        }
+    }
+
+    static auto erase(std::shared_ptr<Node>& node, std::size_t index, std::size_t count) -> void {
+        Node& n = own(node);
+
+        n.size -= count;
+
+        if (n.leaf()) {
+            n.lines.erase(n.lines.begin() + index, n.lines.begin() + index + count);
+            return;
+        }
+
+        for (std::size_t k = 0; k < n.children.size() && count > 0;) {
+            std::size_t size = n.children[k]->size;
+
+            if (index >= size) {
+                index -= size;
+                ++k;
+                continue;
+            }
+
+            std::size_t taken = std::min(count, size - index);
+
+            if (taken == size) {
+                n.children.erase(n.children.begin() + k);
+            } else {
+                erase(n.children[k], index, taken);
+                ++k;
+            }
+
+            count -= taken;
+            index = 0;
+        }
+
+        // merge neighbours that fit in one node, so deletions don't leave
+        // a trail of near-empty leaves
+        for (std::size_t k = 0; k + 1 < n.children.size();) {
+            if (n.children[k]->entries() + n.children[k + 1]->entries() > fanout) {
+                ++k;
+                continue;
+            }
+
+            Node& into = own(n.children[k]);
+            Node const& from = *n.children[k + 1];
+
+            into.lines.insert(into.lines.end(), from.lines.begin(), from.lines.end());
+            into.children.insert(into.children.end(), from.children.begin(), from.children.end());
+            into.size += from.size;
+            n.children.erase(n.children.begin() + k + 1);
+        }
+    }
+
+    auto erase(std::size_t index, std::size_t count) -> void {
+        erase(root, index, count);
+
+        while (!root->leaf() && root->children.size() == 1)
+            root = root->children.front();
+
+        if (!root->leaf() && root->children.empty())
+            root = std::make_shared<Node>();
+    }
+
+    // replaces everything, numbering the lines from `version` on
+    auto assign(std::vector<std::string> text, std::uint64_t& version) -> void {
+        std::vector<std::shared_ptr<Node>> level;
+
+        for (std::size_t start = 0; start < text.size(); start += fanout) {
+            auto leaf = std::make_shared<Node>();
+            std::size_t end = std::min(text.size(), start + fanout);
+
+            leaf->lines.reserve(end - start);
+
+            for (std::size_t i = start; i < end; ++i)
+                leaf->lines.push_back(Line{std::move(text[i]), ++version});
+
+            leaf->size = end - start;
+            level.push_back(std::move(leaf));
+        }
+
+        while (level.size() > 1) {
+            std::vector<std::shared_ptr<Node>> above;
+
+            for (std::size_t start = 0; start < level.size(); start += fanout) {
+                auto node = std::make_shared<Node>();
+
+                node->children.assign(level.begin() + start, level.begin() + std::min(level.size(), start + fanout));
+
+                for (auto& child: node->children)
+                    node->size += child->size;
+
+                above.push_back(std::move(node));
+            }
+
+            level = std::move(above);
+        }
+
+        root = level.empty() ? std::make_shared<Node>() : std::move(level.front());
+    }
+};
+
+// bytes `expand` appends for the graphemes that start before byte `to`
+inline auto expanded_size(std::string_view text, int i, int cell, int first, int last, int tab, int to) -> int {
+    int size = 0;
+
+    while (i < to && i < static_cast<int>(text.size()) && cell < last) {
+        int next = next_grapheme(text, i);
+        int w = cell_width(text, i, cell, tab);
+
+        if (text[i] == '\t' || cell < first || cell + w > last)
+            size += std::max(0, std::min(cell + w, last) - std::max(cell, first));
+        else
+            size += next - i;
+
+        cell += w;
+        i = next;
+    }
+
+    return size;
+}
+
+// Per-line display width data keyed by line version: plain lines map
+// bytes to cells directly, others (non-ASCII or tab separated) keep a
+// (byte, cell) mark every 256 bytes so lookups only rescan a short
+// stretch.
+struct Columns {
+    struct Entry {
+        bool plain = true;
+        std::vector<std::pair<int, int>> marks;
+    };
+
+    int tab = 8;
+    std::unordered_map<std::uint64_t, Entry> cache;
+
+    // nodes of retired versions, reused so editing a line doesn't allocate
+    std::vector<std::unordered_map<std::uint64_t, Entry>::node_type> spare;
+
+    auto retire(std::uint64_t version) -> void {
+        if (auto node = cache.extract(version); node && spare.size() < 64)
+            spare.push_back(std::move(node));
+    }
+
+    auto fill(std::string_view line, Entry& entry) -> void {
+        entry.plain = is_plain(line);
+        entry.marks.clear();
+
+        if (entry.plain)
+            return;
+
+        int cells = 0;
+        int mark = 0;
+
+        for (int i = 0; i < static_cast<int>(line.size()); i = next_grapheme(line, i)) {
+            if (i >= mark) {
+                entry.marks.emplace_back(i, cells);
+                mark = i + 256;
+            }
+
+            cells += cell_width(line, i, cells, tab);
+        }
+
+        entry.marks.emplace_back(line.size(), cells);
+    }
+
+    auto entry(std::string_view line, std::uint64_t version) -> Entry const& {
+        if (auto it = cache.find(version); it != cache.end())
+            return it->second;
+
+        if (cache.size() >= 4096)
+            cache.clear();
+
+        if (spare.empty()) {
+            auto& entry = cache[version];
+
+            fill(line, entry);
+
+            return entry;
+        }
+
+        auto node = std::move(spare.back());
+
+        spare.pop_back();
+        node.key() = version;
+        fill(line, node.mapped());
+
+        return cache.insert(std::move(node)).position->second;
+    }
+
+    // cell column of byte offset `byte`
+    auto cells(std::string_view line, std::uint64_t version, int byte) -> int {
+        auto& e = entry(line, version);
+
+        if (e.plain)
+            return byte;
+
+        auto it = std::upper_bound(e.marks.begin(), e.marks.end(), byte, [](int byte, auto& mark) { return byte < mark.first; });
+        auto [i, cells] = *std::prev(it);
+
+        for (; i < byte; i = next_grapheme(line, i))
+            cells += cell_width(line, i, cells, tab);
+
+        return cells;
+    }
+
+    // byte offset and starting cell of the grapheme covering cell column
+    // `cell`, or of the line end
+    auto find(std::string_view line, std::uint64_t version, int cell) -> std::pair<int, int> {
+        auto& e = entry(line, version);
+
+        if (e.plain) {
+            int byte = std::min(cell, static_cast<int>(line.size()));
+
+            return {byte, byte};
+        }
+
+        auto it = std::upper_bound(e.marks.begin(), e.marks.end(), cell, [](int cell, auto& mark) { return cell < mark.second; });
+        auto [i, cells] = *std::prev(it);
+
+        while (i < static_cast<int>(line.size())) {
+            int w = cell_width(line, i, cells, tab);
+
+            if (cells + w > cell)
+                break;
+
+            cells += w;
+            i = next_grapheme(line, i);
+        }
+
+        return {i, cells};
+    }
+
+    auto byte_at(std::string_view line, std::uint64_t version, int cell) -> int {
+        return find(line, version, cell).first;
+    }
+
+    // appends the cells [first, first + width) of the line
+    auto expand(std::string_view line, std::uint64_t version, int first, int width, std::string& out) -> void {
+        if (entry(line, version).plain) {
+            if (first < static_cast<int>(line.size()))
+                out.append(line.substr(first, width));
+
+            return;
+        }
+
+        auto [i, cell] = find(line, version, first);
+
+        ::expand(line, i, cell, first, first + width, tab, out);
+    }
+};
+
+// Per-line screen row counts as a B-tree: leaves hold up to `fanout`
+// counts, and every node keeps its total of lines and rows, so a count
+// can be changed, lines inserted or erased anywhere, and lines mapped to
+// rows and back, all in O(log n).
+struct Rows {
+    struct Node {
+        int lines = 0;
+        int rows = 0;
+        std::vector<int> counts;
+        std::vector<std::unique_ptr<Node>> children;
+
+        auto leaf() const -> bool {
+            return children.empty();
+        }
+
+        auto entries() const -> std::size_t {
+            return leaf() ? counts.size() : children.size();
+        }
+    };
+
+    static constexpr std::size_t fanout = 64;
+
+    std::unique_ptr<Node> root = std::make_unique<Node>();
+
+    auto size() const -> int {
+        return root->lines;
+    }
+
+    // the child holding line `index`, which becomes an index into it; one
+    // past the end goes to the last child
+    static auto locate(Node const& node, int& index) -> std::size_t {
+        std::size_t k = 0;
+
+        for (; k + 1 < node.children.size() && index >= node.children[k]->lines; ++k)
+            index -= node.children[k]->lines;
+
+        return k;
+    }
+
+    auto assign(std::span<int const> counts) -> void {
+        std::vector<std::unique_ptr<Node>> level;
+
+        for (std::size_t start = 0; start < counts.size(); start += fanout) {
+            auto leaf = std::make_unique<Node>();
+
+            leaf->counts.assign(counts.begin() + start, counts.begin() + std::min(counts.size(), start + fanout));
+            leaf->lines = leaf->counts.size();
+
+            for (int count: leaf->counts)
+                leaf->rows += count;
+
+            level.push_back(std::move(leaf));
+        }
+
+        while (level.size() > 1) {
+            std::vector<std::unique_ptr<Node>> above;
+
+            for (std::size_t start = 0; start < level.size(); start += fanout) {
+                auto node = std::make_unique<Node>();
+
+                for (std::size_t k = start; k < std::min(level.size(), start + fanout); ++k) {
+                    node->lines += level[k]->lines;
+                    node->rows += level[k]->rows;
+                    node->children.push_back(std::move(level[k]));
+                }
+
+                above.push_back(std::move(node));
+            }
+
+            level = std::move(above);
+        }
+
+        root = level.empty() ? std::make_unique<Node>() : std::move(level.front());
+    }
+
+    auto at(int index) const -> int {
+        Node const *node = root.get();
+
+        while (!node->leaf())
+            node = node->children[locate(*node, index)].get();
+
+        return node->counts[index];
+    }
+
+    static auto set(Node& node, int index, int count) -> int {
+        int delta;
+
+        if (node.leaf()) {
+            delta = count - node.counts[index];
+            node.counts[index] = count;
+        } else {
+            std::size_t k = locate(node, index);
+
+            delta = set(*node.children[k], index, count);
+        }
+
+        node.rows += delta;
+
+        return delta;
+    }
+
+    auto set(int index, int count) -> void {
+        set(*root, index, count);
+    }
+
+    // splits an overfull node evenly, keeping the first part in place and
+    // returning the rest, which go right after it in its parent
+    static auto split(Node& node) -> std::vector<std::unique_ptr<Node>> {
+        std::vector<std::unique_ptr<Node>> rest;
+        std::size_t total = node.entries();
+
+        if (total <= fanout)
+            return rest;
+
+        std::size_t parts = (total + fanout - 1) / fanout;
+        std::size_t keep = total / parts + (total % parts > 0);
+
+        for (std::size_t start = keep, part = 1; part < parts; ++part) {
+            std::size_t count = total / parts + (total % parts > part);
+            auto next = std::make_unique<Node>();
+
+            if (node.leaf()) {
+                next->counts.assign(node.counts.begin() + start, node.counts.begin() + start + count);
+                next->lines = count;
+
+                for (int c: next->counts)
+                    next->rows += c;
+            } else {
+                for (std::size_t k = start; k < start + count; ++k) {
+                    next->lines += node.children[k]->lines;
+                    next->rows += node.children[k]->rows;
+                    next->children.push_back(std::move(node.children[k]));
+                }
+            }
+
+            node.lines -= next->lines;
+            node.rows -= next->rows;
+            rest.push_back(std::move(next));
+            start += count;
+        }
+
+        if (node.leaf())
+            node.counts.resize(keep);
+        else
+            node.children.resize(keep);
+
+        return rest;
+    }
+
+    static auto insert(Node& node, int index, int count, int value) -> std::vector<std::unique_ptr<Node>> {
+        node.lines += count;
+        node.rows += count * value;
+
+        if (node.leaf()) {
+            node.counts.insert(node.counts.begin() + index, count, value);
+            return split(node);
+        }
+
+        std::size_t k = locate(node, index);
+        auto rest = insert(*node.children[k], index, count, value);
+
+        node.children.insert(node.children.begin() + k + 1, std::make_move_iterator(rest.begin()), std::make_move_iterator(rest.end()));
+
+        return split(node);
+    }
+
+    // inserts `count` lines of `value` rows each before line `index`
+    auto insert(int index, int count, int value) -> void {
+        auto rest = insert(*root, index, count, value);
+
+        while (!rest.empty()) {
+            auto top = std::make_unique<Node>();
+
+            top->lines = root->lines;
+            top->rows = root->rows;
+            top->children.push_back(std::move(root));
+
+            for (auto& next: rest) {
+                top->lines += next->lines;
+                top->rows += next->rows;
+                top->children.push_back(std::move(next));
+            }
+
+            root = std::move(top);
+            rest = split(*root);
+        }
+    }
+
+    // erases `count` lines from line `index` on, returning their rows
+    static auto erase(Node& node, int index, int count) -> int {
+        int removed = 0;
+
+        node.lines -= count;
+
+        if (node.leaf()) {
+            for (int i = index; i < index + count; ++i)
+                removed += node.counts[i];
+
+            node.counts.erase(node.counts.begin() + index, node.counts.begin() + index + count);
+            node.rows -= removed;
+
+            return removed;
+        }
+
+        for (std::size_t k = 0; k < node.children.size() && count > 0;) {
+            int size = node.children[k]->lines;
+
+            if (index >= size) {
+                index -= size;
+                ++k;
+                continue;
+            }
+
+            int taken = std::min(count, size - index);
+
+            if (taken == size) {
+                removed += node.children[k]->rows;
+                node.children.erase(node.children.begin() + k);
+            } else {
+                removed += erase(*node.children[k], index, taken);
+                ++k;
+            }
+
+            count -= taken;
+            index = 0;
+        }
+
+        // merge neighbours that fit in one node, so deletions don't leave
+        // a trail of near-empty leaves
+        for (std::size_t k = 0; k + 1 < node.children.size();) {
+            if (node.children[k]->entries() + node.children[k + 1]->entries() > fanout) {
+                ++k;
+                continue;
+            }
+
+            Node& into = *node.children[k];
+            Node& from = *node.children[k + 1];
+
+            into.counts.insert(into.counts.end(), from.counts.begin(), from.counts.end());
+            into.children.insert(into.children.end(), std::make_move_iterator(from.children.begin()), std::make_move_iterator(from.children.end()));
+            into.lines += from.lines;
+            into.rows += from.rows;
+            node.children.erase(node.children.begin() + k + 1);
+        }
+
+        node.rows -= removed;
+
+        return removed;
+    }
+
+    auto erase(int index, int count) -> void {
+        erase(*root, index, count);
+
+        while (!root->leaf() && root->children.size() == 1)
+            root = std::move(root->children.front());
+
+        if (!root->leaf() && root->children.empty())
+            root = std::make_unique<Node>();
+    }
+
+    // rows before line `index`
+    auto row_of(int index) const -> int {
+        Node const *node = root.get();
+        int total = 0;
+
+        while (!node->leaf()) {
+            std::size_t k = 0;
+
+            for (; k + 1 < node->children.size() && index >= node->children[k]->lines; ++k) {
+                index -= node->children[k]->lines;
+                total += node->children[k]->rows;
+            }
+
+            node = node->children[k].get();
+        }
+
+        for (int i = 0; i < std::min(index, static_cast<int>(node->counts.size())); ++i)
+            total += node->counts[i];
+
+        return total;
+    }
+
+    // line containing `row` and the row within that line; rows past the
+    // end go to the last row of the last line
+    auto line_at(int row) const -> std::pair<int, int> {
+        if (row >= root->rows)
+            return {root->lines - 1, at(root->lines - 1) - 1};
+
+        Node const *node = root.get();
+        int index = 0;
+
+        while (!node->leaf()) {
+            std::size_t k = 0;
+
+            for (; row >= node->children[k]->rows; ++k) {
+                row -= node->children[k]->rows;
+                index += node->children[k]->lines;
+            }
+
+            node = node->children[k].get();
+        }
+
+        std::size_t i = 0;
+
+        for (; row >= node->counts[i]; ++i)
+            row -= node->counts[i];
+
+        return {index + static_cast<int>(i), row};
+    }
+
+    // bytes held by the nodes, for the stats dump
+    auto memory() const -> std::size_t {
+        std::size_t bytes = 0;
+        std::vector<Node const *> stack = {root.get()};
+
+        while (!stack.empty()) {
+            Node const *node = stack.back();
+
+            stack.pop_back();
+            bytes += sizeof(Node) + node->counts.capacity() * sizeof(int) + node->children.capacity() * sizeof(node->children[0]);
+
+            for (auto& child: node->children)
+                stack.push_back(child.get());
+        }
+
+        return bytes;
+    }
+};
+
+// Soft-wrap layout: wrap points are cached per line version for the
+// current width, and a B-tree of per-line row counts maps between lines
+// and screen rows in O(log n).
+struct Layout {
+    int width = 0;
+    int tab = 8;
+    bool stale = true;
+    Rows rows;
+    std::vector<int> pending;
+    std::vector<int> single = {0};
+    std::unordered_map<std::uint64_t, std::vector<int>> cache;
+    std::vector<std::unordered_map<std::uint64_t, std::vector<int>>::node_type> spare;
+
+    auto wrap_points(std::string_view line, std::vector<int>& points) -> void {
+        int size = line.size();
+
+        points.assign(1, 0);
+
+        if (is_plain(line)) {
+            int start = 0;
+
+            while (size - start > width) {
+                int end = start + width;
+                int space = static_cast<int>(line.rfind(' ', end - 1));
+
+                start = space > start ? space + 1 : end;
+                points.push_back(start);
+            }
+
+            return;
+        }
+
+        int cells = 0;
+        int space = 0;
+
+        for (int i = 0; i < size; i = next_grapheme(line, i)) {
+            int w = cell_width(line, i, cells, tab);
+
+            // a grapheme wider than the whole row still starts a row of
+            // its own, but not a second one at the same byte
+            if (cells + w > width && i > points.back()) {
+                int start = space > points.back() ? space : i;
+
+                points.push_back(start);
+                cells = measure(line.substr(start, i - start), tab);
+                w = cell_width(line, i, cells, tab);
+            }
+
+            cells += w;
+
+            if (line[i] == ' ')
+                space = i + 1;
+        }
+    }
+
+    auto retire(std::uint64_t version) -> void {
+        if (auto node = cache.extract(version); node && spare.size() < 64)
+            spare.push_back(std::move(node));
+    }
+
+    auto breaks(std::string const& line, std::uint64_t version) -> std::vector<int> const& {
+        if (static_cast<int>(line.size()) <= width && !line.contains('\t'))
+            return single;
+
+        if (auto it = cache.find(version); it != cache.end())
+            return it->second;
+
+        if (cache.size() >= 4096)
+            cache.clear();
+
+        if (spare.empty()) {
+            auto& points = cache[version];
+
+            wrap_points(line, points);
+
+            return points;
+        }
+
+        auto node = std::move(spare.back());
+
+        spare.pop_back();
+        node.key() = version;
+        wrap_points(line, node.mapped());
+
+        return cache.insert(std::move(node)).position->second;
+    }
+
+    auto update(Lines const& lines, int columns) -> void {
+        if (std::max(1, columns) != width) {
+            width = std::max(1, columns);
+            cache.clear();
+            stale = true;
+        }
+
+        if (stale) {
+            std::vector<int> counts(lines.size());
+
+            for (std::size_t i = 0; i < lines.size();) {
+                for (auto& l: lines.chunk(i))
+                    counts[i++] = breaks(l.text, l.version).size();
+            }
+
+            rows.assign(counts);
+            pending.clear();
+            stale = false;
+            return;
+        }
+
+        for (int index: pending) {
+            auto& l = lines.at(index);
+
+            rows.set(index, breaks(l.text, l.version).size());
+        }
+
+        pending.clear();
+    }
+
+    auto touch(int index) -> void {
+        if (!stale)
+            pending.push_back(index);
+    }
+
+    auto insert(int index, int count = 1) -> void {
+        if (stale)
+            return;
+
+        for (int& p: pending)
+            if (p >= index)
+                p += count;
+
+        rows.insert(index, count, 1);
+
+        for (int i = index; i < index + count; ++i)
+            pending.push_back(i);
+    }
+
+    auto erase(int index, int count = 1) -> void {
+        if (stale)
+            return;
+
+        std::erase_if(pending, [&](int p) { return p >= index && p < index + count; });
+
+        for (int& p: pending)
+            if (p >= index + count)
+                p -= count;
+
+        rows.erase(index, count);
+    }
+
+    // rows before line `index`
+    auto row_of(int index) -> int {
+        return rows.row_of(index);
+    }
+
+    // line containing `row` and the row within that line
+    auto line_at(int row) -> std::pair<int, int> {
+        return rows.line_at(row);
+    }
+
+    // row within the line and cell column of byte `column`
+    auto locate(std::string const& line, std::uint64_t version, int column) -> std::pair<int, int> {
+        auto& points = breaks(line, version);
+        int row = std::upper_bound(points.begin(), points.end(), column) - points.begin() - 1;
+
+        return {row, measure(std::string_view(line).substr(points[row], column - points[row]), tab)};
+    }
+};
+
+// 64-bit hash of a byte range, eight bytes at a time; used to recognize
+// file contents and paths, not as a defence against anyone
+inline auto hash_bytes(std::string_view bytes, std::uint64_t h = 0x9E3779B97F4A7C15) -> std::uint64_t {
+    std::size_t i = 0;
+
+    for (; i + 8 <= bytes.size(); i += 8) {
+        std::uint64_t chunk;
+
+        std::memcpy(&chunk, bytes.data() + i, 8);
+        h = (h ^ chunk) * 0xBF58476D1CE4E5B9;
+        h ^= h >> 31;
+    }
+
+    for (; i < bytes.size(); ++i)
+        h = (h ^ static_cast<unsigned char>(bytes[i])) * 0x94D049BB133111EB;
+
+    return h ^ (h >> 29);
+}
+
+// Undo history as a log of splices rather than snapshots: each record
+// holds the position, the text removed and inserted there and the cursor
+// before and after, followed by the record's own size so the log can be
+// walked backwards. Records past `applied` are the redo side; typing
+// extends the last record instead of adding one per key. A batch record
+// holds many edits within lines, undone together: a table of pieces
+// comes before the text, which is then every piece's removed text
+// followed by every piece's inserted text.
+//
+// Offsets are into the whole log. With a file attached, the log lives in
+// it and memory keeps a window of at most about `limit` bytes: the tail
+// that hasn't been written yet, or whatever undo and redo last needed.
+// The file starts with the hash of the text on disk and the offset at
+// which the history matches it, so reopening unchanged text resumes it.
+struct History {
+    struct Header {
+        std::uint32_t line;
+        std::uint32_t column;
+        std::uint32_t before_line;
+        std::uint32_t before_column;
+        std::uint32_t after_line;
+        std::uint32_t after_column;
+        std::uint64_t removed;
+        std::uint64_t inserted;
+        std::uint64_t pieces;
+    };
+
+    // one edit of a batch, within a line; the column is where it starts
+    // in the text before the batch
+    struct Piece {
+        std::uint32_t line;
+        std::uint32_t column;
+        std::uint32_t removed;
+        std::uint32_t inserted;
+    };
+
+    struct Record {
+        Header h;
+        std::string_view table;
+        std::string_view removed;
+        std::string_view inserted;
+
+        auto piece(std::size_t k) const -> Piece {
+            Piece p;
+
+            std::memcpy(&p, table.data() + k * sizeof(p), sizeof(p));
+
+            return p;
+        }
+    };
+
+    static constexpr std::string_view magic = "epp undo 2\n";
+    static constexpr std::size_t prologue = magic.size() + 2 * sizeof(std::uint64_t);
+    static constexpr std::size_t limit = 1 << 20;
+    static constexpr std::uint64_t unsaved = -1;
+
+    std::string log;
+    std::size_t base = 0;
+    std::size_t end = 0;
+    std::size_t flushed = 0;
+    std::size_t applied = 0;
+    std::size_t last = 0;
+    std::uint64_t saved_at = 0;
+    std::uint64_t content = 0;
+    bool merging = false;
+    int fd = -1;
+
+    History() = default;
+    History(History const&) = delete;
+    auto operator=(History const&) -> History& = delete;
+
+    ~History() {
+        detach();
+    }
+
+    auto at(std::size_t offset) -> char * {
+        return log.data() + (offset - base);
+    }
+
+    auto clear() -> void {
+        detach();
+        log.clear();
+        base = end = flushed = applied = last = 0;
+        saved_at = 0;
+        merging = false;
+    }
+
+    // continues the history kept in `path` if it was left at text hashing
+    // to `hash`, and starts it over otherwise
+    auto attach(std::string const& path, std::uint64_t hash) -> void {
+        clear();
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+        if (fd < 0)
+            return;
+
+        std::array<char, prologue> head;
+        std::uint64_t stored[2];
+        struct stat st;
+
+        content = hash;
+
+        if (fstat(fd, &st) == 0 && pread(fd, head.data(), head.size(), 0) == static_cast<ssize_t>(head.size())
+            && std::string_view(head.data(), magic.size()) == magic) {
+            std::memcpy(stored, head.data() + magic.size(), sizeof(stored));
+
+            std::size_t size = st.st_size - prologue;
+
+            if (stored[0] == hash && stored[1] <= size) {
+                base = end = flushed = size;
+                applied = saved_at = stored[1];
+                return;
+            }
+        }
+
+        if (ftruncate(fd, 0) == 0)
+            stamp();
+    }
+
+    // the file doesn't hold together: starts the history over in it
+    auto discard() -> void {
+        log.clear();
+        base = end = flushed = applied = last = 0;
+        saved_at = unsaved;
+        merging = false;
+
+        if (fd >= 0 && ftruncate(fd, 0) != 0)
+            detach();
+
+        stamp();
+    }
+
+    auto detach() -> void {
+        if (fd < 0)
+            return;
+
+        flush();
+        close(fd);
+        fd = -1;
+    }
+
+    auto stamp() -> void {
+        std::array<char, prologue> head;
+        std::uint64_t stored[2] = {content, saved_at};
+
+        std::ranges::copy(magic, head.begin());
+        std::memcpy(head.data() + magic.size(), stored, sizeof(stored));
+
+        if (fd >= 0 && pwrite(fd, head.data(), head.size(), 0) != static_cast<ssize_t>(head.size()))
+            detach();
+    }
+
+    // the text now matches what was just written to disk
+    auto saved(std::uint64_t hash) -> void {
+        content = hash;
+        saved_at = applied;
+        flush();
+        stamp();
+    }
+
+    auto write(std::size_t from, std::size_t to) -> void {
+        if (fd >= 0 && pwrite(fd, at(from), to - from, prologue + from) != static_cast<ssize_t>(to - from)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    auto flush() -> void {
+        if (fd < 0 || flushed == end)
+            return;
+
+        write(flushed, end);
+        flushed = end;
+    }
+
+    // writes out all but the last record once the window outgrows the limit
+    auto spill() -> void {
+        if (fd < 0 || log.size() <= limit || last <= base)
+            return;
+
+        if (last > flushed) {
+            write(std::max(base, flushed), last);
+            flushed = last;
+        }
+
+        log.erase(0, last - base);
+        base = last;
+
+        if (log.capacity() > 2 * limit)
+            log.shrink_to_fit();
+    }
+
+    // makes [from, to) resident, reading a window around it from the file
+    auto ensure(std::size_t from, std::size_t to) -> bool {
+        if (from >= base && to <= base + log.size())
+            return true;
+
+        if (fd < 0)
+            return false;
+
+        flush();
+
+        std::size_t start = std::min(from, to > limit / 2 ? to - limit / 2 : 0);
+        std::size_t stop = std::max(to, std::min(end, from + limit / 2));
+
+        log.resize(stop - start);
+        base = start;
+
+        if (pread(fd, log.data(), log.size(), prologue + start) == static_cast<ssize_t>(log.size()))
+            return true;
+
+        log.clear();
+        base = end;
+
+        return false;
+    }
+
+    // drops the redo side and makes the end of the log resident
+    auto truncate() -> void {
+        end = applied;
+
+        if (saved_at != unsaved && applied < saved_at) {
+            saved_at = unsaved;
+            stamp();
+        }
+
+        if (applied < flushed) {
+            flushed = applied;
+
+            if (fd >= 0 && ftruncate(fd, prologue + applied) != 0)
+                detach();
+        }
+
+        if (applied < base || applied > base + log.size()) {
+            log.clear();
+            base = applied;
+        }
+
+        log.resize(applied - base);
+    }
+
+    auto header(std::size_t offset) -> Header {
+        Header h;
+
+        std::memcpy(&h, at(offset), sizeof(h));
+
+        return h;
+    }
+
+    // bytes taken by the record `h` heads, or 0 when that is more than the
+    // `room` there is for it, as in a damaged file
+    static auto length(Header const& h, std::size_t room) -> std::size_t {
+        if (h.pieces > room / sizeof(Piece) || h.removed > room || h.inserted > room)
+            return 0;
+
+        std::size_t size = sizeof(h) + h.pieces * sizeof(Piece) + h.removed + h.inserted + sizeof(std::uint64_t);
+
+        return size <= room ? size : 0;
+    }
+
+    auto seal() -> void {
+        std::uint64_t size = log.size() - (last - base) + sizeof(size);
+
+        log.append(reinterpret_cast<char const *>(&size), sizeof(size));
+        end = applied = base + log.size();
+    }
+
+    auto record(Header h, std::string_view removed, std::string_view inserted, std::span<Piece const> pieces = {}) -> void {
+        truncate();
+        last = end;
+        h.removed = removed.size();
+        h.inserted = inserted.size();
+        h.pieces = pieces.size();
+        log.append(reinterpret_cast<char const *>(&h), sizeof(h));
+        log.append(reinterpret_cast<char const *>(pieces.data()), pieces.size_bytes());
+        log.append(removed);
+        log.append(inserted);
+        seal();
+        spill();
+        merging = false;
+    }
+
+    // `count` copies of `c` typed at (line, column)
+    auto type(int line, int column, char c, int count) -> void {
+        Header h;
+
+        if (merging && applied == end && last >= flushed && last >= base && (h = header(last)).pieces == 0
+            && h.after_line == static_cast<std::uint32_t>(line) && h.after_column == static_cast<std::uint32_t>(column)) {
+            log.resize(log.size() - sizeof(std::uint64_t));
+        } else {
+            h = {static_cast<std::uint32_t>(line), static_cast<std::uint32_t>(column), static_cast<std::uint32_t>(line),
+                static_cast<std::uint32_t>(column), 0, 0, 0, 0, 0};
+            record(h, {}, {});
+            log.resize(log.size() - sizeof(std::uint64_t));
+        }
+
+        log.append(count, c);
+        h.inserted += count;
+        h.after_line = line;
+        h.after_column = column + count;
+        std::memcpy(at(last), &h, sizeof(h));
+        seal();
+        merging = true;
+    }
+
+    // steps back over the last applied record
+    auto undo(Record& r) -> bool {
+        if (applied == 0)
+            return false;
+
+        std::uint64_t size;
+
+        if (applied < sizeof(size)) {
+            discard();
+            return false;
+        }
+
+        if (!ensure(applied - sizeof(size), applied))
+            return false;
+
+        std::memcpy(&size, at(applied - sizeof(size)), sizeof(size));
+
+        if (size < sizeof(Header) + sizeof(size) || size > applied) {
+            discard();
+            return false;
+        }
+
+        if (!ensure(applied - size, applied))
+            return false;
+
+        if (length(header(applied - size), size) != size) {
+            discard();
+            return false;
+        }
+
+        applied -= size;
+        merging = false;
+        read(applied, r);
+
+        return true;
+    }
+
+    auto redo(Record& r) -> bool {
+        if (applied == end)
+            return false;
+
+        if (end - applied < sizeof(Header)) {
+            discard();
+            return false;
+        }
+
+        if (!ensure(applied, applied + sizeof(Header)))
+            return false;
+
+        std::size_t size = length(header(applied), end - applied);
+
+        if (size == 0) {
+            discard();
+            return false;
+        }
+
+        if (!ensure(applied, applied + size))
+            return false;
+
+        read(applied, r);
+        applied += size;
+        merging = false;
+
+        return true;
+    }
+
+    auto read(std::size_t offset, Record& r) -> void {
+        char const *p = at(offset) + sizeof(Header);
+
+        r.h = header(offset);
+        r.table = std::string_view(p, r.h.pieces * sizeof(Piece));
+        r.removed = std::string_view(p + r.table.size(), r.h.removed);
+        r.inserted = std::string_view(p + r.table.size() + r.h.removed, r.h.inserted);
+    }
+};
+
+// Regular expressions over bytes: literals, ., [classes], \d \w \s and
+// their negations, groups, |, *, + and ?, and ^ and $ at the ends of a
+// line. A pattern compiles to a Thompson NFA, and the DFA for it is
+// built lazily, one transition at a time as text asks for it, so a
+// pattern that is searched again reuses the states built the first time.
+// Matches are leftmost-longest.
+struct Regex {
+    struct Node {
+        enum Kind { bytes, split, jump, begin, end, match };
+
+        Kind kind;
+        int out = -1;
+        int out1 = -1;
+        std::bitset<256> set;
+    };
+
+    struct State {
+        std::vector<int> set;
+        bool accepting = false;
+        // accepting if the text ends here
+        bool final = false;
+        bool dead = false;
+        std::array<std::atomic<int>, 256> next;
+    };
+
+    // Transitions are read without locking and filled in under the mutex;
+    // past `limit` states new ones aren't kept, and matching carries on
+    // over sets of NFA nodes instead.
+    struct Dfa {
+        static constexpr int limit = 4096;
+
+        bool floating;
+        std::unique_ptr<std::unique_ptr<State>[]> states = std::make_unique<std::unique_ptr<State>[]>(limit);
+        int count = 0;
+        std::map<std::vector<int>, int> index;
+        std::mutex mutex;
+        // at the start of a line and anywhere else
+        std::array<int, 2> starts = {-1, -1};
+
+        explicit Dfa(bool floating) : floating(floating) {}
+    };
+
+    // a piece of NFA still missing the node(s) it continues to
+    struct Fragment {
+        int start = -1;
+        std::vector<std::pair<int, int>> outs;
+    };
+
+    std::vector<Node> nodes;
+    int start = -1;
+    // what every match starts with, and whether that is all the pattern is
+    std::string prefix;
+    bool literal = true;
+    bool prefixing = true;
+    std::string error;
+    // floating matches may start anywhere; anchored ones where they begin
+    Dfa floating{true};
+    Dfa anchored{false};
+
+    explicit Regex(std::string_view pattern) {
+        std::size_t i = 0;
+        Fragment whole = alternation(pattern, i, 0);
+
+        if (error.empty() && i < pattern.size())
+            error = "unmatched )";
+
+        if (!error.empty()) {
+            prefix.clear();
+            return;
+        }
+
+        patch(whole.outs, node(Node::match));
+        start = whole.start;
+
+        for (Dfa *dfa: {&floating, &anchored})
+            dfa->starts = {add(*dfa, closure({start}, true)), add(*dfa, closure({start}, false))};
+    }
+
+    auto node(Node::Kind kind, int out = -1, int out1 = -1) -> int {
+        nodes.push_back(Node{kind, out, out1, {}});
+
+        return nodes.size() - 1;
+    }
+
+    auto patch(std::vector<std::pair<int, int>> const& outs, int target) -> void {
+        for (auto [n, which]: outs)
+            (which == 0 ? nodes[n].out : nodes[n].out1) = target;
+    }
+
+    auto alternation(std::string_view p, std::size_t& i, int depth) -> Fragment {
+        Fragment left = concatenation(p, i, depth);
+
+        while (error.empty() && i < p.size() && p[i] == '|') {
+            ++i;
+
+            if (depth == 0) {
+                prefix.clear();
+                prefixing = false;
+            }
+
+            literal = false;
+
+            Fragment right = concatenation(p, i, depth);
+            int s = node(Node::split, left.start, right.start);
+
+            left.start = s;
+            left.outs.insert(left.outs.end(), right.outs.begin(), right.outs.end());
+        }
+
+        return left;
+    }
+
+    auto concatenation(std::string_view p, std::size_t& i, int depth) -> Fragment {
+        Fragment whole;
+
+        while (error.empty() && i < p.size() && p[i] != '|' && p[i] != ')') {
+            std::size_t before = i;
+            int byte = -1;
+            Fragment piece = atom(p, i, depth, byte);
+            char quantifier = i < p.size() && std::string_view("*+?").contains(p[i]) ? p[i] : 0;
+
+            // leading literal bytes, up to the first one that may repeat
+            // or be left out; a leading ^ doesn't end them
+            if (depth == 0 && prefixing) {
+                if (byte >= 0 && quantifier != '*' && quantifier != '?')
+                    prefix += static_cast<char>(byte);
+
+                if (byte >= 0 ? quantifier != 0 : before != 0 || p[before] != '^')
+                    prefixing = false;
+            }
+
+            for (; error.empty() && i < p.size() && std::string_view("*+?").contains(p[i]); ++i) {
+                literal = false;
+
+                if (p[i] == '*') {
+                    int s = node(Node::split, piece.start);
+
+                    patch(piece.outs, s);
+                    piece = {s, {{s, 1}}};
+                } else if (p[i] == '+') {
+                    int s = node(Node::split, piece.start);
+
+                    patch(piece.outs, s);
+                    piece.outs = {{s, 1}};
+                } else {
+                    int s = node(Node::split, piece.start);
+
+                    piece.start = s;
+                    piece.outs.push_back({s, 1});
+                }
+            }
+
+            if (whole.start < 0) {
+                whole = std::move(piece);
+            } else {
+                patch(whole.outs, piece.start);
+                whole.outs = std::move(piece.outs);
+            }
+        }
+
+        // an empty alternative is a jump straight to what follows, so it
+        // matches the empty string, as in `a|`
+        if (whole.start < 0) {
+            int j = node(Node::jump);
+
+            whole = {j, {{j, 0}}};
+        }
+
+        return whole;
+    }
+
+    // `byte` is set when the atom is a single literal byte
+    auto atom(std::string_view p, std::size_t& i, int depth, int& byte) -> Fragment {
+        char c = p[i++];
+        std::bitset<256> set;
+
+        switch (c) {
+        case '*':
+        case '+':
+        case '?':
+            error = "nothing to repeat";
+            return {};
+        case '(': {
+            literal = false;
+
+            Fragment inner = alternation(p, i, depth + 1);
+
+            if (error.empty() && (i == p.size() || p[i] != ')'))
+                error = "unmatched (";
+
+            ++i;
+
+            return inner;
+        }
+        case '^':
+        case '$': {
+            literal = false;
+
+            int n = node(c == '^' ? Node::begin : Node::end);
+
+            return {n, {{n, 0}}};
+        }
+        case '.':
+            literal = false;
+            set.set();
+            break;
+        case '[':
+            literal = false;
+            set = bracket(p, i);
+            break;
+        case '\\':
+            if (i == p.size()) {
+                error = "trailing \\";
+                return {};
+            }
+
+            set = escape(p[i++]);
+            byte = only(set);
+            literal = literal && byte >= 0;
+            break;
+        default:
+            set.set(static_cast<unsigned char>(c));
+            byte = static_cast<unsigned char>(c);
+            break;
+        }
+
+        int n = node(Node::bytes);
+
+        nodes[n].set = set;
+
+        return {n, {{n, 0}}};
+    }
+
+    // the byte a set holds if it holds just one, else -1
+    static auto only(std::bitset<256> const& set) -> int {
+        if (set.count() != 1)
+            return -1;
+
+        int b = 0;
+
+        while (!set[b])
+            ++b;
+
+        return b;
+    }
+
+    static auto escape(char c) -> std::bitset<256> {
+        std::bitset<256> set;
+        auto range = [&](char from, char to) {
+            for (int b = from; b <= to; ++b)
+                set.set(b);
+        };
+
+        switch (c) {
+        case 'd':
+        case 'D':
+            range('0', '9');
+            break;
+        case 'w':
+        case 'W':
+            range('0', '9');
+            range('a', 'z');
+            range('A', 'Z');
+            set.set('_');
+            break;
+        case 's':
+        case 'S':
+            for (char b: std::string_view(" \t\r\n\f\v"))
+                set.set(b);
+            break;
+        case 't':
+            set.set('\t');
+            return set;
+        default:
+            set.set(static_cast<unsigned char>(c));
+            return set;
+        }
+
+        return c >= 'A' && c <= 'Z' ? ~set : set;
+    }
+
+    auto bracket(std::string_view p, std::size_t& i) -> std::bitset<256> {
+        std::bitset<256> set;
+        bool negated = i < p.size() && p[i] == '^';
+
+        if (negated)
+            ++i;
+
+        for (bool first = true; i < p.size() && (first || p[i] != ']'); first = false) {
+            unsigned char c = p[i++];
+
+            if (c == '\\' && i < p.size()) {
+                auto escaped = escape(p[i++]);
+
+                if (only(escaped) < 0) {
+                    set |= escaped;
+                    continue;
+                }
+
+                c = only(escaped);
+            }
+
+            if (i + 1 < p.size() && p[i] == '-' && p[i + 1] != ']') {
+                unsigned char last = p[i + 1];
+
+                i += 2;
+
+                for (int b = c; b <= last; ++b)
+                    set.set(b);
+            } else {
+                set.set(c);
+            }
+        }
+
+        if (i == p.size())
+            error = "unmatched [";
+
+        ++i;
+
+        return negated ? ~set : set;
+    }
+
+    // the nodes reachable from `seeds` without reading a byte, passing ^
+    // only at the start of a line and $ only at its end; nodes that read
+    // or wait on $ are kept
+    auto closure(std::vector<int> seeds, bool at_begin, bool at_end = false) const -> std::vector<int> {
+        std::vector<int> set;
+        std::vector<char> seen(nodes.size());
+
+        while (!seeds.empty()) {
+            int n = seeds.back();
+
+            seeds.pop_back();
+
+            if (n < 0 || seen[n])
+                continue;
+
+            seen[n] = true;
+
+            auto& node = nodes[n];
+
+            switch (node.kind) {
+            case Node::split:
+                seeds.push_back(node.out1);
+                seeds.push_back(node.out);
+                break;
+            case Node::jump:
+                seeds.push_back(node.out);
+                break;
+            case Node::begin:
+                if (at_begin)
+                    seeds.push_back(node.out);
+                break;
+            case Node::end:
+                if (at_end)
+                    seeds.push_back(node.out);
+                else
+                    set.push_back(n);
+                break;
+            case Node::bytes:
+            case Node::match:
+                set.push_back(n);
+                break;
+            }
+        }
+
+        std::ranges::sort(set);
+
+        return set;
+    }
+
+    auto advance(std::vector<int> const& set, unsigned char c, bool floating) const -> std::vector<int> {
+        std::vector<int> seeds;
+
+        for (int n: set)
+            if (nodes[n].kind == Node::bytes && nodes[n].set[c])
+                seeds.push_back(nodes[n].out);
+
+        if (floating)
+            seeds.push_back(start);
+
+        return closure(std::move(seeds), false);
+    }
+
+    auto accepts(std::vector<int> const& set) const -> bool {
+        return std::ranges::any_of(set, [&](int n) { return nodes[n].kind == Node::match; });
+    }
+
+    auto accepts_at_end(std::vector<int> const& set) const -> bool {
+        return accepts(closure(set, false, true));
+    }
+
+    // the state for `set`, made if it's new; -1 once the DFA is full.
+    // Callers hold the mutex unless the DFA isn't shared yet.
+    auto add(Dfa& dfa, std::vector<int> set) -> int {
+        if (auto it = dfa.index.find(set); it != dfa.index.end())
+            return it->second;
+
+        if (dfa.count == Dfa::limit)
+            return -1;
+
+        auto state = std::make_unique<State>();
+
+        state->accepting = accepts(set);
+        state->final = accepts_at_end(set);
+        state->dead = set.empty();
+
+        for (auto& next: state->next)
+            next.store(-1, std::memory_order_relaxed);
+
+        state->set = std::move(set);
+        dfa.index.emplace(state->set, dfa.count);
+        dfa.states[dfa.count] = std::move(state);
+
+        return dfa.count++;
+    }
+
+    auto step(Dfa& dfa, int s, unsigned char c) -> int {
+        auto& state = *dfa.states[s];
+
+        if (int t = state.next[c].load(std::memory_order_acquire); t >= 0)
+            return t;
+
+        std::lock_guard lock(dfa.mutex);
+
+        if (int t = state.next[c].load(std::memory_order_relaxed); t >= 0)
+            return t;
+
+        int t = add(dfa, advance(state.set, c, dfa.floating));
+
+        if (t >= 0)
+            state.next[c].store(t, std::memory_order_release);
+
+        return t;
+    }
+
+    // where a match from `from` ends: the first end for a floating search
+    // with `earliest`, else the last one; npos if there is none
+    auto run(std::string_view text, std::size_t from, bool floating_match, bool earliest) -> std::size_t {
+        Dfa& dfa = floating_match ? floating : anchored;
+        std::size_t found = std::string_view::npos;
+        int s = dfa.starts[from == 0 ? 0 : 1];
+
+        for (std::size_t i = from;; ++i) {
+            auto& state = *dfa.states[s];
+
+            if (state.accepting) {
+                found = i;
+
+                if (earliest)
+                    return i;
+            }
+
+            if (state.dead)
+                return found;
+
+            if (i == text.size())
+                return state.final ? i : found;
+
+            int t = step(dfa, s, text[i]);
+
+            if (t < 0)
+                return simulate(text, i, state.set, floating_match, earliest, found);
+
+            s = t;
+        }
+    }
+
+    // run() without the DFA, for patterns that outgrew it
+    auto simulate(std::string_view text, std::size_t i, std::vector<int> set, bool floating_match, bool earliest, std::size_t found) const -> std::size_t {
+        for (;; ++i) {
+            set = advance(set, text[i], floating_match);
+
+            if (accepts(set)) {
+                found = i + 1;
+
+                if (earliest)
+                    return found;
+            }
+
+            if (set.empty())
+                return found;
+
+            if (i + 1 == text.size())
+                return accepts_at_end(set) ? text.size() : found;
+        }
+    }
+
+    auto contains(std::string_view text) -> bool {
+        if (start < 0)
+            return false;
+
+        if (literal)
+            return find_substring(text, prefix) != std::string_view::npos;
+
+        std::size_t from = 0;
+
+        // no match can start before the first copy of the prefix
+        if (!prefix.empty() && (from = find_substring(text, prefix)) == std::string_view::npos)
+            return false;
+
+        return run(text, from, true, true) != std::string_view::npos;
+    }
+
+    // the leftmost match starting at or after `from`: where and how long
+    auto first(std::string_view text, std::size_t from) -> std::pair<std::size_t, std::size_t> {
+        constexpr auto none = std::pair{std::string_view::npos, std::size_t{0}};
+
+        if (start < 0 || from > text.size())
+            return none;
+
+        if (literal)
+            return {find_substring(text, prefix, from), prefix.size()};
+
+        // it starts no later than the earliest match ends
+        std::size_t bound = run(text, from, true, true);
+
+        for (std::size_t p = from; p <= bound && bound != std::string_view::npos; ++p) {
+            if (!prefix.empty() && (p = find_substring(text, prefix, p)) == std::string_view::npos)
+                break;
+
+            if (std::size_t end = run(text, p, false, false); end != std::string_view::npos)
+                return {p, end - p};
+        }
+
+        return none;
+    }
+};
+
+// A stretch of a frame row drawn highlighted, in bytes of the row
+struct Highlight {
+    int row;
+    int first;
+    int last;
+    bool current;
+};
+
+// One pass of a search over a snapshot of the text, split into blocks
+// that workers claim in turn. The lines to check come as runs starting
+// from the line the search started on and wrapping around, so results
+// put together in block order are in the order the cursor reaches them.
+// With a replacement, each matching line is also rewritten, and the
+// pieces for the undo record are noted.
+struct Scan {
+    static constexpr std::size_t block = 1024;
+
+    Lines lines;
+    std::string query;
+    // when the query is a regular expression
+    std::shared_ptr<Regex> pattern;
+    // lines to check one by one, or else [first, last) runs of them with
+    // how many lines come before each run
+    std::vector<int> candidates;
+    std::vector<std::pair<int, int>> runs;
+    std::vector<std::size_t> offsets;
+    std::size_t count = 0;
+    int wake;
+    std::vector<std::vector<int>> results;
+    // per block when replacing: the matching lines' new text, the pieces
+    // and the text they take out
+    std::optional<std::string> replacement;
+    std::vector<std::vector<std::string>> rewritten;
+    std::vector<std::vector<History::Piece>> pieces;
+    std::vector<std::string> taken;
+    std::unique_ptr<std::atomic<bool>[]> done;
+    std::atomic<std::size_t> next = 0;
+    std::atomic<std::size_t> finished = 0;
+    std::atomic<bool> cancelled = false;
+
+    Scan(Lines lines, std::string query, std::shared_ptr<Regex> pattern, std::vector<std::pair<int, int>> runs, std::vector<int> const *candidates, int wake)
+        : lines(std::move(lines)), query(std::move(query)), pattern(std::move(pattern)), wake(wake) {
+        if (candidates) {
+            this->candidates = *candidates;
+            count = this->candidates.size();
+        } else {
+            this->runs = std::move(runs);
+
+            for (auto [first, last]: this->runs) {
+                offsets.push_back(count);
+                count += last - first;
+            }
+        }
+
+        results.resize(blocks());
+        rewritten.resize(blocks());
+        pieces.resize(blocks());
+        taken.resize(blocks());
+        done = std::make_unique<std::atomic<bool>[]>(blocks());
+    }
+
+    auto blocks() const -> std::size_t {
+        return (count + block - 1) / block;
+    }
+
+    auto matches(std::string_view text) -> bool {
+        return pattern ? pattern->contains(text) : find_substring(text, query) != std::string_view::npos;
+    }
+
+    auto first(std::string_view text, std::size_t from) -> std::pair<std::size_t, std::size_t> {
+        return pattern ? pattern->first(text, from) : std::pair{find_substring(text, query, from), query.size()};
+    }
+
+    // notes line `i` of block `b` as a match, and rewrites it when
+    // replacing: every match is found first, so the new text is sized
+    // once and built in one pass
+    auto keep(std::size_t b, int i, std::string_view text) -> void {
+        results[b].push_back(i);
+
+        if (!replacement)
+            return;
+
+        auto& out = pieces[b];
+        std::size_t start = out.size();
+        std::size_t size = text.size();
+
+        // an empty match is followed by the byte after it
+        for (auto [at, length] = first(text, 0); at != std::string_view::npos; std::tie(at, length) = first(text, at + std::max<std::size_t>(length, 1))) {
+            out.push_back({static_cast<std::uint32_t>(i), static_cast<std::uint32_t>(at), static_cast<std::uint32_t>(length), static_cast<std::uint32_t>(replacement->size())});
+            taken[b].append(text.substr(at, length));
+            size = size - length + replacement->size();
+        }
+
+        auto& line = rewritten[b].emplace_back();
+        std::size_t from = 0;
+
+        line.reserve(size);
+
+        for (auto& piece: std::span(out).subspan(start)) {
+            line.append(text.substr(from, piece.column - from));
+            line += *replacement;
+            from = piece.column + piece.removed;
+        }
+
+        line.append(text.substr(from));
+    }
+
+    auto check(std::size_t b) -> void {
+        std::size_t last = std::min(count, (b + 1) * block);
+
+        if (runs.empty()) {
+            for (std::size_t k = b * block; k < last; ++k)
+                if (matches(lines[candidates[k]]))
+                    keep(b, candidates[k], lines[candidates[k]]);
+
+            return;
+        }
+
+        for (std::size_t rank = b * block; rank < last;) {
+            std::size_t r = std::upper_bound(offsets.begin(), offsets.end(), rank) - offsets.begin() - 1;
+            std::size_t i = runs[r].first + (rank - offsets[r]);
+            std::size_t stop = std::min(last - rank, runs[r].second - i);
+            auto chunk = lines.chunk(i);
+
+            for (auto& l: chunk.first(std::min(chunk.size(), stop))) {
+                if (matches(l.text))
+                    keep(b, i, l.text);
+
+                ++i;
+                ++rank;
+            }
+        }
+    }
+
+    // claims and checks blocks until none are left or the scan is called
+    // off, writing `wake` after each one
+    auto work() -> void {
+        for (std::size_t b; !cancelled.load(std::memory_order_relaxed) && (b = next.fetch_add(1)) < blocks();) {
+            check(b);
+            done[b].store(true, std::memory_order_release);
+            finished.fetch_add(1, std::memory_order_release);
+            finished.notify_all();
+
+            if (wake >= 0)
+                eventfd_write(wake, 1);
+        }
+    }
+
+    auto wait() -> void {
+        for (std::size_t f = finished.load(std::memory_order_acquire); f < blocks(); f = finished.load(std::memory_order_acquire))
+            finished.wait(f, std::memory_order_acquire);
+    }
+};
+
+// Worker threads for scans, started on first use. Only the newest scan is
+// handed out; workers still busy with an older one find it cancelled and
+// come back.
+struct Pool {
+    std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    std::mutex mutex;
+    std::condition_variable_any wake;
+    std::shared_ptr<Scan> current;
+    std::uint64_t generation = 0;
+    std::vector<std::jthread> workers;
+
+    // calls off the scan being worked on, so the workers stop after the
+    // block in hand instead of finishing it before they are joined
+    ~Pool() {
+        std::lock_guard lock(mutex);
+
+        if (current)
+            current->cancelled = true;
+    }
+
+    auto run(std::shared_ptr<Scan> scan) -> void {
+        while (workers.size() < threads)
+            workers.emplace_back([this](std::stop_token stop) { work(stop); });
+
+        {
+            std::lock_guard lock(mutex);
+
+            current = std::move(scan);
+            ++generation;
+        }
+
+        wake.notify_all();
+    }
+
+    auto work(std::stop_token stop) -> void {
+        for (std::uint64_t seen = 0;;) {
+            std::shared_ptr<Scan> scan;
+
+            {
+                std::unique_lock lock(mutex);
+
+                if (!wake.wait(lock, stop, [&] { return generation != seen; }))
+                    return;
+
+                seen = generation;
+                scan = current;
+            }
+
+            if (scan)
+                scan->work();
+
+            // every block is claimed; the snapshot can go once the rest
+            // of the workers are done with it
+            std::lock_guard lock(mutex);
+
+            if (current == scan)
+                current.reset();
+        }
+    }
+};
+
+// Trigram index for search: for every three-byte sequence, the blocks of
+// lines it occurs in. Blocks start out as Scan::block lines each; `edits`
+// keeps their bounds on the current lines as lines come and go, and the
+// runs of lines changed since they were indexed. absorb() adds those
+// lines' trigrams to their blocks, so a block may list a trigram its text
+// lost, which only costs a scan that finds nothing there.
+struct Trigrams {
+    static constexpr std::string_view magic = "epp index 2\n";
+
+    using Postings = std::unordered_map<std::uint32_t, std::vector<std::uint32_t>>;
+
+    // Where each block starts on the current lines, then where the text
+    // ends, and the runs of lines changed or inserted since they were
+    // indexed, as sorted [first, last).
+    struct Edits {
+        static constexpr std::size_t limit = 4096;
+
+        std::vector<int> starts = {0};
+        std::vector<std::pair<int, int>> dirty;
+        // a block grew so much that it no longer narrows a search
+        bool oversized = false;
+
+        // blocks of Scan::block lines over `size` lines
+        static auto fresh(std::size_t size) -> Edits {
+            Edits edits;
+
+            for (std::size_t start = Scan::block; start < size; start += Scan::block)
+                edits.starts.push_back(start);
+
+            edits.starts.push_back(size);
+
+            return edits;
+        }
+
+        auto blocks() const -> std::size_t {
+            return starts.size() - 1;
+        }
+
+        // the block holding line `index`; empty blocks hold none
+        auto block(int index) const -> std::size_t {
+            auto it = std::upper_bound(starts.begin() + 1, starts.end() - 1, index);
+
+            return it - starts.begin() - 1;
+        }
+
+        auto changed(int first, int last) -> void {
+            auto it = std::ranges::lower_bound(dirty, first, {}, &std::pair<int, int>::second);
+
+            if (it == dirty.end() || it->first > last) {
+                dirty.insert(it, {first, last});
+                return;
+            }
+
+            it->first = std::min(it->first, first);
+            it->second = std::max(it->second, last);
+
+            auto next = it + 1;
+
+            for (; next != dirty.end() && next->first <= it->second; ++next)
+                it->second = std::max(it->second, next->second);
+
+            dirty.erase(it + 1, next);
+        }
+
+        // lines inserted where a block starts go into that block, and at
+        // the end of the text into the last one
+        auto inserted(int at, int count) -> void {
+            std::size_t b = block(at);
+
+            for (std::size_t k = 1; k < starts.size(); ++k)
+                if (starts[k] > at || k + 1 == starts.size())
+                    starts[k] += count;
+
+            oversized = oversized || starts[b + 1] - starts[b] > 16 * static_cast<int>(Scan::block);
+
+            for (auto& [first, last]: dirty) {
+                if (first >= at)
+                    first += count;
+
+                if (last > at)
+                    last += count;
+            }
+
+            changed(at, at + count);
+        }
+
+        auto removed(int at, int count) -> void {
+            auto shift = [&](int& position) {
+                position = position >= at + count ? position - count : std::min(position, at);
+            };
+
+            for (int& start: starts)
+                shift(start);
+
+            for (auto& [first, last]: dirty) {
+                shift(first);
+                shift(last);
+            }
+
+            std::erase_if(dirty, [](auto run) { return run.first == run.second; });
+        }
+    };
+
+    std::shared_ptr<Postings> postings = std::make_shared<Postings>();
+    Edits edits;
+    // lines indexed again since the build
+    std::size_t absorbed = 0;
+
+    auto size() const -> std::size_t {
+        return edits.starts.back();
+    }
+
+    // time to build afresh: blocks too big to narrow a search, or more
+    // lines indexed again than the text has
+    auto stale() const -> bool {
+        return edits.oversized || absorbed > std::max(size(), Edits::limit);
+    }
+
+    static auto gram(std::string_view text, std::size_t i) -> std::uint32_t {
+        return static_cast<unsigned char>(text[i]) << 16 | static_cast<unsigned char>(text[i + 1]) << 8 | static_cast<unsigned char>(text[i + 2]);
+    }
+
+    static auto grams(std::string_view text, std::vector<std::uint32_t>& out) -> void {
+        for (std::size_t i = 0; i + 3 <= text.size(); ++i)
+            out.push_back(gram(text, i));
+    }
+
+    // indexes `lines`, giving up with nullptr once `stop` is requested
+    static auto build(Lines const& lines, std::stop_token stop) -> std::unique_ptr<Trigrams> {
+        auto index = std::make_unique<Trigrams>();
+        std::vector<std::uint32_t> found;
+        std::vector<std::uint32_t> unique;
+        std::vector<bool> seen(1 << 24);
+        auto& postings = *index->postings;
+
+        index->edits = Edits::fresh(lines.size());
+
+        for (std::size_t i = 0, b = 0; i < lines.size(); ++b) {
+            if (stop.stop_requested())
+                return nullptr;
+
+            found.clear();
+
+            for (std::size_t last = std::min(lines.size(), i + Scan::block); i < last;) {
+                auto chunk = lines.chunk(i);
+
+                for (auto& l: chunk.first(std::min(chunk.size(), last - i))) {
+                    grams(l.text, found);
+                    ++i;
+                }
+            }
+
+            // each trigram once per block, without sorting the block's
+            // tens of thousands of them
+            unique.clear();
+
+            for (auto key: found) {
+                if (!seen[key]) {
+                    seen[key] = true;
+                    unique.push_back(key);
+                }
+            }
+
+            for (auto key: unique) {
+                seen[key] = false;
+                postings[key].push_back(b);
+            }
+        }
+
+        return index;
+    }
+
+    // adds the trigrams of the lines changed since they were indexed to
+    // their blocks. The postings are copied first while a write to the
+    // sidecar still reads them; use_count() is a relaxed load, hence the
+    // fence, as in Lines::own.
+    auto absorb(Lines const& lines) -> void {
+        if (edits.dirty.empty())
+            return;
+
+        if (postings.use_count() > 1)
+            postings = std::make_shared<Postings>(*postings);
+        else
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+        std::vector<std::uint32_t> found;
+        std::size_t current = edits.block(edits.dirty.front().first);
+
+        auto add = [&] {
+            std::ranges::sort(found);
+            found.erase(std::unique(found.begin(), found.end()), found.end());
+
+            for (auto key: found) {
+                auto& list = (*postings)[key];
+                auto it = std::ranges::lower_bound(list, current);
+
+                if (it == list.end() || *it != current)
+                    list.insert(it, current);
+            }
+
+            found.clear();
+        };
+
+        for (auto [first, last]: edits.dirty) {
+            for (int i = first; i < last;) {
+                auto chunk = lines.chunk(i);
+
+                for (auto& l: chunk.first(std::min<std::size_t>(chunk.size(), last - i))) {
+                    if (std::size_t b = edits.block(i); b != current) {
+                        add();
+                        current = b;
+                    }
+
+                    grams(l.text, found);
+                    ++i;
+                }
+            }
+
+            absorbed += last - first;
+        }
+
+        add();
+        edits.dirty.clear();
+    }
+
+    // the runs of current lines that may contain `text`, or nothing when
+    // it is too short to have a trigram
+    auto lookup(std::string_view text) const -> std::optional<std::vector<std::pair<int, int>>> {
+        if (text.size() < 3)
+            return std::nullopt;
+
+        std::vector<std::uint32_t> keys;
+
+        grams(text, keys);
+        std::ranges::sort(keys);
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+        std::vector<std::vector<std::uint32_t> const *> lists;
+
+        for (auto key: keys) {
+            auto it = postings->find(key);
+
+            if (it == postings->end()) {
+                lists.clear();
+                break;
+            }
+
+            lists.push_back(&it->second);
+        }
+
+        std::vector<std::uint32_t> blocks;
+
+        // intersected starting from the shortest list
+        if (!lists.empty()) {
+            std::ranges::sort(lists, {}, [](auto *list) { return list->size(); });
+            blocks = *lists.front();
+
+            for (auto *list: std::span(lists).subspan(1)) {
+                std::vector<std::uint32_t> both;
+
+                std::ranges::set_intersection(blocks, *list, std::back_inserter(both));
+                blocks = std::move(both);
+            }
+        }
+
+        std::vector<std::pair<int, int>> runs;
+
+        for (auto b: blocks) {
+            int first = edits.starts[b];
+            int last = edits.starts[b + 1];
+
+            if (first < last)
+                runs.push_back({first, last});
+        }
+
+        runs.insert(runs.end(), edits.dirty.begin(), edits.dirty.end());
+        std::ranges::sort(runs);
+
+        std::vector<std::pair<int, int>> merged;
+
+        for (auto run: runs) {
+            if (!merged.empty() && run.first <= merged.back().second)
+                merged.back().second = std::max(merged.back().second, run.second);
+            else
+                merged.push_back(run);
+        }
+
+        return merged;
+    }
+
+    // the sidecar: a header naming the file's modification time and size,
+    // the line count and the number of blocks, where each block starts,
+    // then each trigram with its blocks. It only reads `postings`, so it
+    // can run on its own thread while the editor goes on.
+    static auto write(std::string const& path, std::pair<std::int64_t, std::int64_t> stamp, Postings const& postings, std::vector<int> const& starts) -> void {
+        std::string temporary = path + ".tmp";
+        std::ofstream out(temporary, std::ios::binary);
+        std::uint64_t header[] = {static_cast<std::uint64_t>(stamp.first), static_cast<std::uint64_t>(stamp.second), static_cast<std::uint64_t>(starts.back()), starts.size() - 1, postings.size()};
+
+        out << magic;
+        out.write(reinterpret_cast<char const *>(header), sizeof(header));
+        out.write(reinterpret_cast<char const *>(starts.data()), starts.size() * sizeof(starts[0]));
+
+        for (auto& [key, blocks]: postings) {
+            std::uint32_t counts[] = {key, static_cast<std::uint32_t>(blocks.size())};
+
+            out.write(reinterpret_cast<char const *>(counts), sizeof(counts));
+            out.write(reinterpret_cast<char const *>(blocks.data()), blocks.size() * sizeof(blocks[0]));
+        }
+
+        out.close();
+
+        if (out)
+            std::rename(temporary.c_str(), path.c_str());
+        else
+            std::remove(temporary.c_str());
+    }
+
+    // the index saved for the file as it is now, if there is one. Every
+    // count in it is checked against what is left of the file, and every
+    // block against the lines indexed, so a damaged one is passed over
+    // rather than trusted.
+    static auto read(std::string const& path, std::pair<std::int64_t, std::int64_t> stamp) -> std::unique_ptr<Trigrams> {
+        std::error_code error;
+        std::uint64_t remaining = std::filesystem::file_size(path, error);
+        std::ifstream in(path, std::ios::binary);
+        std::string header(magic.size(), 0);
+        std::uint64_t fields[5];
+
+        in.read(header.data(), header.size());
+        in.read(reinterpret_cast<char *>(fields), sizeof(fields));
+
+        if (error || !in || header != magic || fields[0] != static_cast<std::uint64_t>(stamp.first) || fields[1] != static_cast<std::uint64_t>(stamp.second))
+            return nullptr;
+
+        std::uint32_t counts[2];
+        std::uint64_t blocks = fields[3];
+
+        remaining -= header.size() + sizeof(fields);
+
+        if (fields[2] > std::numeric_limits<int>::max() || blocks >= remaining / sizeof(int) || fields[4] > remaining / sizeof(counts))
+            return nullptr;
+
+        auto index = std::make_unique<Trigrams>();
+        auto& starts = index->edits.starts;
+
+        starts.resize(blocks + 1);
+        remaining -= starts.size() * sizeof(starts[0]);
+
+        if (!in.read(reinterpret_cast<char *>(starts.data()), starts.size() * sizeof(starts[0])))
+            return nullptr;
+
+        // from the first line to the last, never going back
+        if (starts.front() != 0 || static_cast<std::uint64_t>(starts.back()) != fields[2] || std::ranges::adjacent_find(starts, std::greater{}) != starts.end())
+            return nullptr;
+
+        index->postings->reserve(fields[4]);
+
+        for (std::uint64_t k = 0; k < fields[4]; ++k) {
+            if (!in.read(reinterpret_cast<char *>(counts), sizeof(counts)))
+                return nullptr;
+
+            remaining -= sizeof(counts);
+
+            if (counts[0] >= 1 << 24 || counts[1] > remaining / sizeof(std::uint32_t))
+                return nullptr;
+
+            auto& list = (*index->postings)[counts[0]];
+
+            list.resize(counts[1]);
+            remaining -= list.size() * sizeof(list[0]);
+
+            if (!in.read(reinterpret_cast<char *>(list.data()), list.size() * sizeof(list[0])))
+                return nullptr;
+
+            // in order, once each, and within the text
+            if (std::ranges::adjacent_find(list, std::greater_equal{}) != list.end() || (!list.empty() && list.back() >= blocks))
+                return nullptr;
+        }
+
+        return index;
+    }
+};
+
+// An index being built on its own thread over a snapshot, with the edits
+// made meanwhile; `done` is set once `result` is ready.
+struct Indexing {
+    std::unique_ptr<Trigrams> result;
+    Trigrams::Edits edits;
+    std::atomic<bool> done = false;
+    std::jthread thread;
+};
+
+// Incremental search state: for growing prefixes of the query, the lines
+// they match. Typing a character only rechecks the lines that matched the
+// shorter query, and deleting one falls back to the set before it. Sets
+// are ordered from the line the search started on, wrapping around, and
+// the newest may still be filled in by a scan running on the pool.
+struct Search {
+    struct Matches {
+        std::size_t length;
+        std::vector<int> lines;
+    };
+
+    bool active = false;
+    std::string query;
+    // the query read as a regular expression, and why it isn't one
+    bool regex = false;
+    std::shared_ptr<Regex> pattern;
+    std::string error;
+    std::vector<Matches> found;
+    int origin_line = 0;
+    int origin_column = 0;
+    std::shared_ptr<Scan> scan;
+    std::size_t collected = 0;
+    // whether the cursor went to a match yet, or still waits for one, and
+    // the direction of a Ctrl-N or Ctrl-P waiting for the scan to reach
+    // the line it goes to
+    bool placed = true;
+    int step = 0;
+    // typing what every match is to be replaced with
+    bool replacing = false;
+    std::string replacement;
+
+    auto matches() const -> std::size_t {
+        return found.empty() ? 0 : found.back().lines.size();
+    }
+
+    // the leftmost match in `text` starting at or after `from`: where it
+    // starts and how long it is
+    auto first(std::string_view text, std::size_t from) -> std::pair<std::size_t, std::size_t> {
+        if (pattern)
+            return pattern->first(text, from);
+
+        return {find_substring(text, query, from), query.size()};
+    }
+
+    // the last match starting before `before`
+    auto last(std::string_view text, std::size_t before) -> std::pair<std::size_t, std::size_t> {
+        if (!pattern)
+            return {before == 0 ? std::string_view::npos : text.rfind(query, before - 1), query.size()};
+
+        std::pair<std::size_t, std::size_t> found = {std::string_view::npos, 0};
+
+        for (auto at = first(text, 0); at.first < before; at = first(text, at.first + 1))
+            found = at;
+
+        return found;
+    }
+
+    auto cancel() -> void {
+        if (scan)
+            scan->cancelled = true;
+
+        scan.reset();
+    }
+
+    // appends the blocks the scan finished, in order; false if none
+    auto collect() -> bool {
+        if (!scan)
+            return false;
+
+        std::size_t before = collected;
+
+        for (; collected < scan->blocks() && scan->done[collected].load(std::memory_order_acquire); ++collected) {
+            auto& block = scan->results[collected];
+
+            found.back().lines.insert(found.back().lines.end(), block.begin(), block.end());
+            block = {};
+        }
+
+        if (collected == scan->blocks())
+            scan.reset();
+
+        return collected != before;
+    }
+};
+
+struct Editor {
+    const char *output = "out";
+    Lines lines;
+    std::uint64_t version = 0;
+    int line = 0;
+    int column = 0;
+    // cursors besides the one at (line, column), in order, and the line a
+    // range of cursors is marked from
+    std::vector<std::pair<int, int>> cursors;
+    int mark = -1;
+    int line_offset = 0;
+    int column_offset = 0;
+    int row_offset = 0;
+    int tab_width = 8;
+    bool wrap = false;
+    bool modified = false;
+    bool running = true;
+    std::pair<std::int64_t, std::int64_t> saved;
+    std::chrono::steady_clock::duration loading{};
+    std::chrono::steady_clock::duration saving{};
+    Layout layout;
+    Columns columns;
+    History history;
+    Search search;
+    // compiled patterns, kept with the DFA states they have built so far
+    std::unordered_map<std::string, std::shared_ptr<Regex>> patterns;
+    Pool pool;
+    // eventfd written as scans make progress; without one they are waited for
+    int wake = -1;
+    // where undo histories are kept across sessions; empty keeps them in
+    // memory only
+    std::string undo_directory;
+    // trigram index for searches, when enabled, and the next one while it
+    // is built; saved in `index_directory` if there is one
+    bool indexed = false;
+    std::unique_ptr<Trigrams> trigrams;
+    std::unique_ptr<Indexing> indexing;
+    std::string index_directory;
+    // writes the sidecar off this thread
+    std::jthread writing;
+
+    auto set_tab_width(int width) -> void {
+        tab_width = width;
+        columns.tab = width;
+        columns.cache.clear();
+        layout.tab = width;
+        layout.cache.clear();
+        layout.stale = true;
+    }
+
+    auto touch(int index) -> void {
+        auto& l = lines.line(index);
+
+        modified = true;
+        columns.retire(l.version);
+        layout.retire(l.version);
+        l.version = ++version;
+        layout.touch(index);
+        track([&](auto& edits) { edits.changed(index, index + 1); });
+    }
+
+    // keeps the indexes' record of edits in step with the text
+    auto track(auto&& change) -> void {
+        if (trigrams)
+            change(trigrams->edits);
+
+        if (indexing)
+            change(indexing->edits);
+    }
+
+    // starts indexing the text as it is now; waited for without an eventfd
+    auto reindex() -> void {
+        auto job = std::make_unique<Indexing>();
+
+        job->edits = Trigrams::Edits::fresh(lines.size());
+
+        if (wake < 0) {
+            job->result = Trigrams::build(lines, {});
+            job->done = true;
+            indexing = std::move(job);
+            return adopt();
+        }
+
+        job->thread = std::jthread([job = job.get(), snapshot = lines, wake = wake](std::stop_token stop) {
+            job->result = Trigrams::build(snapshot, stop);
+            job->done.store(true, std::memory_order_release);
+            eventfd_write(wake, 1);
+        });
+        indexing = std::move(job);
+    }
+
+    // folds scattered edits into the index before they pile up, and
+    // rebuilds it once edits have worn it down
+    auto refresh() -> void {
+        if (!trigrams || indexing)
+            return;
+
+        if (trigrams->edits.dirty.size() > Trigrams::Edits::limit)
+            trigrams->absorb(lines);
+
+        if (trigrams->stale())
+            reindex();
+    }
+
+    // swaps in an index whose build finished, saving it if the text is
+    // still what the file holds
+    auto adopt() -> void {
+        if (!indexing || !indexing->done.load(std::memory_order_acquire))
+            return;
+
+        if (indexing->result) {
+            trigrams = std::move(indexing->result);
+            trigrams->edits = std::move(indexing->edits);
+
+            if (!modified)
+                save_index();
+        }
+
+        indexing.reset();
+    }
+
+    // writes the index next to the undo history, for the file as last
+    // saved or loaded; on its own thread unless there is no eventfd
+    auto save_index() -> void {
+        if (!trigrams || index_directory.empty())
+            return;
+
+        trigrams->absorb(lines);
+
+        std::string path = state_file(index_directory);
+
+        if (wake < 0)
+            return Trigrams::write(path, saved, *trigrams->postings, trigrams->edits.starts);
+
+        writing = std::jthread([postings = std::shared_ptr<Trigrams::Postings const>(trigrams->postings), starts = trigrams->edits.starts, path, when = saved] {
+            Trigrams::write(path, when, *postings, starts);
+        });
+    }
+
+    // text between two positions, lines joined with '\n'
+    auto text_between(int from_line, int from_column, int to_line, int to_column) const -> std::string {
+        std::string text = lines[from_line].substr(from_column);
+
+        for (int i = from_line + 1; i < to_line; ++i) {
+            text += '\n';
+            text += lines[i];
+        }
+
+        text += '\n';
+        text.append(lines[to_line], 0, to_column);
+
+        return text;
+    }
+
+    // where `text` ends when it starts at (at_line, at_column)
+    static auto end_of(int at_line, int at_column, std::string_view text) -> std::pair<int, int> {
+        int breaks = std::ranges::count(text, '\n');
+
+        if (breaks == 0)
+            return {at_line, at_column + static_cast<int>(text.size())};
+
+        return {at_line + breaks, static_cast<int>(text.size() - text.rfind('\n') - 1)};
+    }
+
+    // replaces the text between two positions with `text`, whose lines are
+    // separated by '\n', shifting the following lines at most once
+    auto replace(int from_line, int from_column, int to_line, int to_column, std::string_view text) -> void {
+        std::size_t first = text.find('\n');
+
+        if (from_line == to_line && first == std::string_view::npos) {
+            lines.text(from_line).replace(from_column, to_column - from_column, text);
+            touch(from_line);
+            refresh();
+            return;
+        }
+
+        std::string tail = lines[to_line].substr(to_column);
+        std::vector<Lines::Line> added;
+        auto& current = lines.text(from_line);
+
+        current.resize(from_column);
+        current.append(text.substr(0, first));
+
+        if (first == std::string_view::npos) {
+            current += tail;
+        } else {
+            added.reserve(std::ranges::count(text, '\n'));
+
+            for (std::size_t start = first + 1;;) {
+                std::size_t end = text.find('\n', start);
+
+                added.push_back(Lines::Line{std::string(text.substr(start, end - start))});
+
+                if (end == std::string_view::npos)
+                    break;
+
+                start = end + 1;
+            }
+
+            added.back().text += tail;
+        }
+
+        touch(from_line);
+
+        int at = from_line + 1;
+        int removed = to_line - from_line;
+        int count = added.size();
+        int common = std::min(removed, count);
+
+        for (int i = 0; i < common; ++i) {
+            lines.text(at + i) = std::move(added[i].text);
+            touch(at + i);
+        }
+
+        if (count > removed) {
+            for (int i = common; i < count; ++i)
+                added[i].version = ++version;
+
+            lines.insert(at + common, std::span(added).subspan(common));
+            layout.insert(at + common, count - common);
+            track([&](auto& edits) { edits.inserted(at + common, count - common); });
+        } else if (removed > count) {
+            for (int i = at + common; i < at + removed; ++i) {
+                columns.retire(lines.version(i));
+                layout.retire(lines.version(i));
+            }
+
+            lines.erase(at + common, removed - common);
+            layout.erase(at + common, removed - common);
+            track([&](auto& edits) { edits.removed(at + common, removed - common); });
+        }
+
+        refresh();
+    }
+
+    // every change to the text goes through here or type() so that it
+    // can be undone
+    auto edit(int from_line, int from_column, int to_line, int to_column, std::string_view text, std::pair<int, int> after) -> void {
+        History::Header h = {static_cast<std::uint32_t>(from_line), static_cast<std::uint32_t>(from_column),
+            static_cast<std::uint32_t>(line), static_cast<std::uint32_t>(column),
+            static_cast<std::uint32_t>(after.first), static_cast<std::uint32_t>(after.second), 0, 0, 0};
+
+        if (from_line == to_line)
+            history.record(h, std::string_view(lines[from_line]).substr(from_column, to_column - from_column), text);
+        else
+            history.record(h, text_between(from_line, from_column, to_line, to_column), text);
+
+        replace(from_line, from_column, to_line, to_column, text);
+        std::tie(line, column) = after;
+    }
+
+    // applies the pieces of a batch record, or takes them back, moving the
+    // text of each line they touch once. When no piece pulls what follows
+    // it closer to the start, as typing at several cursors does, the line
+    // is rewritten in place from its end; when none pushes it further, in
+    // place from its start; otherwise into a new string. A record whose
+    // pieces overlap, go backwards or run past the end of their line is
+    // left unapplied, and false returned.
+    auto rewrite(History::Record const& r, bool forward) -> bool {
+        std::size_t removed = 0;
+        std::size_t inserted = 0;
+
+        // piece j, with its text at `rem` and `ins` in the record and moved
+        // by `shift` by the pieces before it on its line: where it starts
+        // in the text as it is, how much it takes out and what it puts in
+        auto part = [&](std::size_t j, std::size_t rem, std::size_t ins, std::ptrdiff_t shift) {
+            auto p = r.piece(j);
+            std::string_view before = r.removed.substr(rem, p.removed);
+            std::string_view after = r.inserted.substr(ins, p.inserted);
+
+            return std::tuple{static_cast<std::size_t>(p.column + (forward ? 0 : shift)), forward ? before.size() : after.size(), forward ? after : before};
+        };
+
+        // the whole record is checked before any line changes
+        {
+            int at = -1;
+            std::size_t size = 0;
+            std::size_t end = 0;
+            std::ptrdiff_t shift = 0;
+
+            for (std::size_t j = 0; j < r.h.pieces; ++j) {
+                auto p = r.piece(j);
+
+                if (static_cast<int>(p.line) < at || p.line >= lines.size() || removed + p.removed > r.removed.size() || inserted + p.inserted > r.inserted.size())
+                    return false;
+
+                if (static_cast<int>(p.line) != at) {
+                    at = p.line;
+                    size = lines[at].size();
+                    end = 0;
+                    shift = 0;
+                }
+
+                std::ptrdiff_t start = p.column + (forward ? 0 : shift);
+                std::size_t gone = forward ? p.removed : p.inserted;
+
+                if (start < static_cast<std::ptrdiff_t>(end) || start + gone > size)
+                    return false;
+
+                end = start + gone;
+                shift += static_cast<std::ptrdiff_t>(p.inserted) - p.removed;
+                removed += p.removed;
+                inserted += p.inserted;
+            }
+
+            removed = 0;
+            inserted = 0;
+        }
+
+        for (std::size_t k = 0, next; k < r.h.pieces; k = next) {
+            int at = r.piece(k).line;
+            std::size_t rem = removed;
+            std::size_t ins = inserted;
+            std::ptrdiff_t shift = 0;
+            // how far the text after each piece moves, and which way
+            std::ptrdiff_t moved = 0;
+            bool later = true;
+            bool earlier = true;
+
+            for (next = k; next < r.h.pieces && static_cast<int>(r.piece(next).line) == at; ++next) {
+                auto p = r.piece(next);
+                std::ptrdiff_t delta = static_cast<std::ptrdiff_t>(p.inserted) - p.removed;
+
+                shift += delta;
+                moved += forward ? delta : -delta;
+                later = later && moved >= 0;
+                earlier = earlier && moved <= 0;
+                rem += p.removed;
+                ins += p.inserted;
+            }
+
+            auto& text = lines.text(at);
+            std::size_t size = text.size();
+            // where the next line's pieces start in the record
+            std::size_t rest[] = {rem, ins};
+
+            if (later) {
+                text.resize(size + moved);
+
+                std::size_t end = size;
+                std::size_t to = text.size();
+
+                for (std::size_t j = next; j-- > k;) {
+                    auto p = r.piece(j);
+
+                    rem -= p.removed;
+                    ins -= p.inserted;
+                    shift -= static_cast<std::ptrdiff_t>(p.inserted) - p.removed;
+
+                    auto [start, gone, put] = part(j, rem, ins, shift);
+
+                    to -= end - start - gone;
+                    std::memmove(text.data() + to, text.data() + start + gone, end - start - gone);
+                    to -= put.size();
+                    std::memcpy(text.data() + to, put.data(), put.size());
+                    end = start;
+                }
+            } else {
+                std::string out;
+                char *into = text.data();
+                std::size_t from = 0;
+                std::size_t to = 0;
+
+                if (!earlier) {
+                    out.resize(size + moved);
+                    into = out.data();
+                }
+
+                rem = removed;
+                ins = inserted;
+                shift = 0;
+
+                for (std::size_t j = k; j < next; ++j) {
+                    auto p = r.piece(j);
+                    auto [start, gone, put] = part(j, rem, ins, shift);
+
+                    std::memmove(into + to, text.data() + from, start - from);
+                    to += start - from;
+                    std::memcpy(into + to, put.data(), put.size());
+                    to += put.size();
+                    from = start + gone;
+                    rem += p.removed;
+                    ins += p.inserted;
+                    shift += static_cast<std::ptrdiff_t>(p.inserted) - p.removed;
+                }
+
+                std::memmove(into + to, text.data() + from, size - from);
+
+                if (earlier)
+                    text.resize(size + moved);
+                else
+                    text = std::move(out);
+            }
+
+            removed = rest[0];
+            inserted = rest[1];
+            touch(at);
+        }
+
+        refresh();
+
+        return true;
+    }
+
+    auto undo() -> void {
+        History::Record r;
+
+        if (!history.undo(r))
+            return;
+
+        if (r.h.pieces > 0) {
+            if (!rewrite(r, false))
+                return;
+        } else {
+            auto [to_line, to_column] = end_of(r.h.line, r.h.column, r.inserted);
+
+            replace(r.h.line, r.h.column, to_line, to_column, r.removed);
+        }
+
+        line = r.h.before_line;
+        column = r.h.before_column;
+    }
+
+    auto redo() -> void {
+        History::Record r;
+
+        if (!history.redo(r))
+            return;
+
+        if (r.h.pieces > 0) {
+            if (!rewrite(r, true))
+                return;
+        } else {
+            auto [to_line, to_column] = end_of(r.h.line, r.h.column, r.removed);
+
+            replace(r.h.line, r.h.column, to_line, to_column, r.inserted);
+        }
+
+        line = r.h.after_line;
+        column = r.h.after_column;
+    }
+
+    // opens an empty line at index `at`, which may be one past the end
+    auto new_line(int at) -> void {
+        if (at < static_cast<int>(lines.size()))
+            edit(at, 0, at, 0, "\n", {at, 0});
+        else
+            edit(at - 1, lines[at - 1].size(), at - 1, lines[at - 1].size(), "\n", {at, 0});
+    }
+
+    auto delete_line() -> void {
+        if (lines.size() == 1)
+            return;
+
+        int last = lines.size() - 1;
+
+        if (line < last)
+            edit(line, 0, line + 1, 0, "", {line, 0});
+        else
+            edit(line - 1, lines[line - 1].size(), line, lines[line].size(), "", {line - 1, 0});
+    }
+
+    auto backspace() -> void {
+        if (column == 0)
+            return;
+
+        int start = previous_grapheme(lines[line], column);
+
+        edit(line, start, line, column, "", {line, start});
+    }
+
+    auto insert(char c, int count = 1) -> void {
+        history.type(line, column, c, count);
+        lines.text(line).insert(column, count, c);
+        column += count;
+        touch(line);
+        refresh();
+    }
+
+    // inserts `text` at the cursor as one undoable edit; pasted lines may
+    // end in \r or \r\n, which become \n
+    auto paste(std::string_view text) -> void {
+        TRACE("paste");
+
+        // pasted into the query or the replacement, up to the first line
+        // break
+        if (search.active) {
+            text = text.substr(0, text.find_first_of("\r\n"));
+
+            if (search.replacing) {
+                search.replacement += text;
+                return;
+            }
+
+            search.query += text;
+
+            return refine();
+        }
+
+        std::string normalized;
+
+        if (text.contains('\r')) {
+            normalized.reserve(text.size());
+
+            for (std::size_t i = 0; i < text.size(); ++i) {
+                if (text[i] != '\r')
+                    normalized += text[i];
+                else if (i + 1 == text.size() || text[i + 1] != '\n')
+                    normalized += '\n';
+            }
+
+            text = normalized;
+        }
+
+        auto after = end_of(line, column, text);
+
+        // the cursors past this one move along with the text after it
+        for (auto& [l, col]: cursors) {
+            if (l == line && col >= column)
+                std::tie(l, col) = std::pair{after.first, after.second + col - column};
+            else if (l > line)
+                l += after.first - line;
+        }
+
+        edit(line, column, line, column, text, after);
+    }
+
+    // replaces the whole buffer
+    auto assign(std::vector<std::string> text) -> void {
+        if (text.empty())
+            text.emplace_back();
+
+        lines.assign(std::move(text), version);
+        cursors.clear();
+        mark = -1;
+        history.clear();
+        stop_search();
+        trigrams.reset();
+        indexing.reset();
+        layout.stale = true;
+        modified = false;
+    }
+
+    // hash of the text as save() writes it
+    auto digest() const -> std::uint64_t {
+        std::uint64_t h = lines.size();
+
+        for (std::size_t i = 0; i < lines.size();) {
+            for (auto& l: lines.chunk(i)) {
+                h = hash_bytes(l.text, h);
+                ++i;
+            }
+        }
+
+        return h;
+    }
+
+    // where state about the edited file is kept in `directory`
+    auto state_file(std::string const& directory) const -> std::string {
+        std::string path = std::filesystem::absolute(output);
+        char name[17];
+
+        std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash_bytes(path)));
+
+        return directory + "/" + name;
+    }
+
+    auto undo_file() const -> std::string {
+        return state_file(undo_directory);
+    }
+
+    auto load() -> void {
+        TRACE("load");
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::string> text;
+
+        std::ifstream f{output};
+
+        std::string file_line;
+
+        while (std::getline(f, file_line))
+            text.push_back(file_line);
+
+        assign(std::move(text));
+        saved = stamp();
+
+        if (!undo_directory.empty())
+            history.attach(undo_file(), digest());
+
+        if (indexed && !index_directory.empty())
+            trigrams = Trigrams::read(state_file(index_directory), saved);
+
+        if (trigrams && trigrams->size() != lines.size())
+            trigrams.reset();
+
+        if (indexed && !trigrams)
+            reindex();
+
+        loading += std::chrono::steady_clock::now() - start;
+    }
+
+    auto save() -> void {
+        TRACE("save");
+
+        auto start = std::chrono::steady_clock::now();
+        std::ofstream f{output};
+
+        for (std::size_t i = 0; i < lines.size();) {
+            for (auto& l: lines.chunk(i)) {
+                f << l.text << '\n';
+                ++i;
+            }
+        }
+
+        f.close();
+
+        modified = false;
+        saved = stamp();
+
+        if (history.fd >= 0)
+            history.saved(digest());
+
+        // the index follows the edits, so it describes the file as saved;
+        // one still being built is saved once it is done
+        if (trigrams)
+            save_index();
+        else if (indexed && !indexing)
+            reindex();
+
+        saving += std::chrono::steady_clock::now() - start;
+    }
+
+    // modification time and size, to tell our own saves from other writers
+    auto stamp() -> std::pair<std::int64_t, std::int64_t> {
+        struct stat st;
+
+        if (stat(output, &st) != 0)
+            return {};
+
+        return {st.st_mtim.tv_sec * 1'000'000'000 + st.st_mtim.tv_nsec, st.st_size};
+    }
+
+    // reloads the file after another program changed it, unless there are
+    // unsaved edits
+    auto revert() -> void {
+        if (modified || stamp() == saved)
+            return;
+
+        load();
+
+        line = std::min(line, static_cast<int>(lines.size()) - 1);
+        column = std::min(column, static_cast<int>(lines[line].size()));
+    }
+
+    // keeps the cursor in the same cell column when changing lines
+    auto move_line(int target) -> void {
+        int cell = columns.cells(lines[line], lines.version(line), column);
+
+        line = target;
+        column = columns.byte_at(lines[line], lines.version(line), cell);
+    }
+
+    auto move(char c) -> void {
+        history.merging = false;
+
+        switch (c) {
+        case 'B':
+            column = previous_grapheme(lines[line], column);
+            break;
+        case 'F':
+            column = next_grapheme(lines[line], column);
+            break;
+        case 'N':
+            move_line(std::min(static_cast<int>(lines.size() - 1), line + 1));
+            break;
+        case 'P':
+            move_line(std::max(0, line - 1));
+            break;
+        case 'A':
+            column = 0;
+            break;
+        case 'E':
+            column = lines[line].size();
+            break;
+        case 'V':
+            move_line(std::min(static_cast<int>(lines.size() - 1), line + 10));
+            break;
+        case 'C':
+            move_line(std::max(0, line - 10));
+            break;
+        case 'Q':
+            running = false;
+            break;
+        }
+    }
+
+    auto input(char c) -> void {
+        TRACE("input");
+
+        if (search.active)
+            return search_key(c);
+
+        // typing, deleting and moving happen at every cursor; edits that
+        // add or remove lines, undo and redo go back to one cursor
+        if (!cursors.empty()) {
+            if (std::string_view{"\nOKUR"}.contains(c))
+                cursors.clear();
+            else if (!std::string_view{"\033SIMYQ"}.contains(c))
+                return at_cursors(c);
+        }
+
+        switch (c) {
+        case '\n':
+            new_line(line + 1);
+            break;
+        case 'O':
+            new_line(line);
+            break;
+        case '\b':
+        case 127:
+            backspace();
+            break;
+        case '\t':
+            insert(' ', 4);
+            break;
+        case 'K':
+            delete_line();
+            break;
+        case 'S':
+            save();
+            break;
+        case 'I':
+            start_search();
+            break;
+        case 'U':
+            undo();
+            break;
+        case 'R':
+            redo();
+            break;
+        case 'M':
+            mark = line;
+            break;
+        case 'Y':
+            cursors_to_mark();
+            break;
+        case '\033':
+            cursors.clear();
+            mark = -1;
+            break;
+        default:
+            if (std::string_view{"BFNPAECVQ"}.contains(c))
+                move(c);
+            else
+                insert(c);
+            break;
+        }
+    }
+
+    // adds a cursor on every line from the mark to the cursor's, in the
+    // cursor's column
+    auto cursors_to_mark() -> void {
+        if (mark < 0 || mark >= static_cast<int>(lines.size()))
+            return;
+
+        int cell = columns.cells(lines[line], lines.version(line), column);
+
+        for (int i = std::min(mark, line); i <= std::max(mark, line); ++i)
+            if (i != line)
+                cursors.push_back({i, columns.byte_at(lines[i], lines.version(i), cell)});
+
+        merge_cursors();
+        mark = -1;
+    }
+
+    // pulls every cursor back onto its line and to the start of a
+    // grapheme, should an edit somewhere else have left it past either
+    auto clamp_cursors() -> void {
+        int last = lines.size() - 1;
+        std::span<Lines::Line const> leaf;
+        int first = 0;
+
+        for (auto& [l, col]: cursors) {
+            l = std::clamp(l, 0, last);
+
+            if (l < first || l >= first + static_cast<int>(leaf.size())) {
+                leaf = lines.chunk(l);
+                first = l;
+            }
+
+            std::string_view text = leaf[l - first].text;
+            int size = text.size();
+
+            col = std::clamp(col, 0, size);
+
+            // between two ASCII bytes is always a boundary
+            if ((col == size || static_cast<unsigned char>(text[col]) < 0x80) && (col == 0 || static_cast<unsigned char>(text[col - 1]) < 0x80))
+                continue;
+
+            if (int start = previous_grapheme(text, col); next_grapheme(text, start) != col)
+                col = start;
+        }
+
+        merge_cursors();
+    }
+
+    // puts the cursors back in order, dropping those that landed on
+    // another; keystrokes keep them in order already
+    auto merge_cursors() -> void {
+        if (!std::ranges::is_sorted(cursors))
+            std::ranges::sort(cursors);
+
+        cursors.erase(std::unique(cursors.begin(), cursors.end()), cursors.end());
+        std::erase(cursors, std::pair{line, column});
+    }
+
+    // a keystroke at every cursor. Motions move each one; text typed or
+    // deleted at all of them makes one batch record, whose pieces change
+    // each line in a single pass, and the cursors then move by what the
+    // pieces before them on their line added or took out.
+    auto at_cursors(char c) -> void {
+        history.merging = false;
+        clamp_cursors();
+
+        auto all = cursors;
+        auto primary = std::ranges::lower_bound(all, std::pair{line, column}) - all.begin();
+
+        all.insert(all.begin() + primary, {line, column});
+
+        History::Header h = {0, 0, static_cast<std::uint32_t>(line), static_cast<std::uint32_t>(column), 0, 0, 0, 0, 0};
+        std::vector<History::Piece> pieces;
+        std::string removed;
+        std::string inserted;
+
+        if (std::string_view{"BFNPAECV"}.contains(c)) {
+            for (auto& position: all) {
+                std::tie(line, column) = position;
+                move(c);
+                position = {line, column};
+            }
+        } else {
+            bool deleting = c == '\b' || c == 127;
+            int count = c == '\t' ? 4 : 1;
+            int at = -1;
+            int shift = 0;
+            // the cursors are in line order, so their lines come a leaf at
+            // a time
+            std::span<Lines::Line const> leaf;
+            int first = 0;
+
+            for (auto& [l, col]: all) {
+                if (l != at) {
+                    at = l;
+                    shift = 0;
+
+                    if (l >= first + static_cast<int>(leaf.size())) {
+                        leaf = lines.chunk(l);
+                        first = l;
+                    }
+                }
+
+                if (!deleting) {
+                    pieces.push_back({static_cast<std::uint32_t>(l), static_cast<std::uint32_t>(col), 0, static_cast<std::uint32_t>(count)});
+                    inserted.append(count, c == '\t' ? ' ' : c);
+                    col += shift + count;
+                    shift += count;
+                } else if (col > 0) {
+                    auto& text = leaf[l - first].text;
+                    int start = previous_grapheme(text, col);
+                    int gone = col - start;
+
+                    pieces.push_back({static_cast<std::uint32_t>(l), static_cast<std::uint32_t>(start), static_cast<std::uint32_t>(gone), 0});
+                    removed.append(text, start, gone);
+                    col = start + shift;
+                    shift -= gone;
+                } else {
+                    col += shift;
+                }
+            }
+        }
+
+        std::tie(line, column) = all[primary];
+        all.erase(all.begin() + primary);
+        cursors = std::move(all);
+
+        if (!pieces.empty()) {
+            h.line = pieces.front().line;
+            h.column = pieces.front().column;
+            h.after_line = line;
+            h.after_column = column;
+            h.removed = removed.size();
+            h.inserted = inserted.size();
+            h.pieces = pieces.size();
+
+            if (rewrite({h, std::string_view(reinterpret_cast<char const *>(pieces.data()), pieces.size() * sizeof(History::Piece)), removed, inserted}, true))
+                history.record(h, removed, inserted, pieces);
+        }
+
+        merge_cursors();
+    }
+
+    auto adjust_offset(int height, int width) -> void {
+        TRACE("adjust_offset");
+
+        if (wrap) {
+            layout.update(lines, width);
+
+            auto [row, x] = layout.locate(lines[line], lines.version(line), column);
+            int cursor_row = layout.row_of(line) + row;
+            int top = layout.row_of(line_offset) + row_offset;
+
+            if (cursor_row < top)
+                top = cursor_row;
+            else if (cursor_row - top >= height)
+                top = cursor_row - height + 1;
+
+            std::tie(line_offset, row_offset) = layout.line_at(top);
+            column_offset = 0;
+            return;
+        }
+
+        int line_count = line + 1;
+
+        if (line_count - line_offset > height)
+            line_offset = line_count - height;
+        else if (line - line_offset < 0)
+            line_offset = line;
+
+        int cell = columns.cells(lines[line], lines.version(line), column);
+
+        if (cell - column_offset >= width)
+            column_offset = cell - width + 1;
+        else if (cell < column_offset)
+            column_offset = cell;
+    }
+
+    auto stop_search() -> void {
+        search.cancel();
+        search = {};
+    }
+
+    auto start_search() -> void {
+        bool regex = search.regex;
+
+        history.merging = false;
+        stop_search();
+        search.regex = regex;
+        search.active = true;
+        search.origin_line = line;
+        search.origin_column = column;
+    }
+
+    auto search_key(char c) -> void {
+        // a step still waiting for the scan gives way to any later key
+        search.step = 0;
+
+        if (search.replacing)
+            return replace_key(c);
+
+        switch (c) {
+        case '\033':
+            line = search.origin_line;
+            column = search.origin_column;
+            search.cancel();
+            search.active = false;
+            break;
+        case '\n':
+        case '\r':
+            // keeps the cursor where it is, on a match or not, rather than
+            // wait for the rest of the text to be scanned
+            search.cancel();
+            search.active = false;
+            break;
+        case 0x0E:
+            next_match(1);
+            break;
+        case 0x10:
+            next_match(-1);
+            break;
+        case 0x14:
+            search.replacing = !search.query.empty() && search.error.empty();
+            break;
+        case 0x04:
+            // leaves a cursor at this match and goes on to the next one
+            if (!search.query.empty() && search.first(lines[line], column).first == static_cast<std::size_t>(column)) {
+                cursors.push_back({line, column});
+                next_match(1);
+                merge_cursors();
+            }
+            break;
+        case 0x12:
+            search.regex = !search.regex;
+            search.cancel();
+            search.found.clear();
+
+            if (search.query.empty())
+                jump();
+            else
+                refine();
+            break;
+        case '\b':
+        case 127:
+            if (search.query.empty())
+                break;
+
+            search.query.pop_back();
+            search.cancel();
+            search.found.pop_back();
+
+            parse();
+
+            if (search.query.empty() || (!search.found.empty() && search.found.back().length == search.query.size()))
+                jump();
+            else
+                refine();
+            break;
+        default:
+            if (static_cast<unsigned char>(c) >= 0x20) {
+                search.query += c;
+                refine();
+            }
+            break;
+        }
+    }
+
+    // the replacement prompt: Enter replaces every match, Escape goes back
+    // to the query
+    auto replace_key(char c) -> void {
+        switch (c) {
+        case '\033':
+            search.replacing = false;
+            search.replacement.clear();
+            break;
+        case '\n':
+        case '\r':
+            replace_all();
+            break;
+        case '\b':
+        case 127:
+            if (!search.replacement.empty())
+                search.replacement.pop_back();
+            break;
+        default:
+            if (static_cast<unsigned char>(c) >= 0x20)
+                search.replacement += c;
+            break;
+        }
+    }
+
+    auto compile(std::string const& pattern) -> std::shared_ptr<Regex> {
+        if (auto it = patterns.find(pattern); it != patterns.end())
+            return it->second;
+
+        if (patterns.size() >= 64)
+            patterns.clear();
+
+        return patterns[pattern] = std::make_shared<Regex>(pattern);
+    }
+
+    auto parse() -> void {
+        search.pattern = search.regex && !search.query.empty() ? compile(search.query) : nullptr;
+        search.error = search.pattern ? search.pattern->error : "";
+    }
+
+    // narrows the last complete set of matching lines down to the query,
+    // or scans every line when there is none; the scan runs on the pool
+    // unless it fits in one block. A longer regular expression may match
+    // more, so those always scan every line.
+    auto refine() -> void {
+        // a set still being filled can't be narrowed
+        if (search.scan) {
+            search.cancel();
+            search.found.pop_back();
+        }
+
+        parse();
+
+        if (!search.error.empty()) {
+            search.found.push_back({search.query.size(), {}});
+            return jump();
+        }
+
+        auto *candidates = search.found.empty() || search.regex ? nullptr : &search.found.back().lines;
+        std::vector<std::pair<int, int>> runs = {{0, static_cast<int>(lines.size())}};
+
+        // the index can narrow further than the matches of a shorter query
+        if (auto found = lookup()) {
+            std::size_t count = 0;
+
+            for (auto [first, last]: *found)
+                count += last - first;
+
+            if (!candidates || count < candidates->size()) {
+                runs = std::move(*found);
+                candidates = nullptr;
+            }
+        }
+
+        auto scan = std::make_shared<Scan>(lines, search.query, search.pattern, from_origin(std::move(runs)), candidates, wake);
+
+        search.found.push_back({search.query.size(), {}});
+        search.scan = scan;
+        search.collected = 0;
+
+        if (scan->blocks() > 1)
+            pool.run(scan);
+        else
+            scan->work();
+
+        if (wake < 0)
+            scan->wait();
+
+        search.collect();
+        jump();
+    }
+
+    // the runs of lines the index says the query may occur in, if there
+    // is an index and the query is long enough for it
+    auto lookup() -> std::optional<std::vector<std::pair<int, int>>> {
+        if (!trigrams)
+            return std::nullopt;
+
+        trigrams->absorb(lines);
+
+        return trigrams->lookup(search.pattern ? std::string_view(search.pattern->prefix) : search.query);
+    }
+
+    // replaces every match of the query as one undoable edit. The lines
+    // to rewrite are the ones the search found, or every line it may
+    // occur in while that is still unknown; the pool and this thread
+    // build their new text, and they are then swapped in one by one.
+    auto replace_all() -> void {
+        if (search.query.empty() || !search.error.empty())
+            return;
+
+        std::vector<int> known;
+        std::vector<std::pair<int, int>> runs = {{0, static_cast<int>(lines.size())}};
+        bool complete = !search.scan && !search.found.empty();
+
+        if (complete) {
+            known = search.found.back().lines;
+            std::ranges::sort(known);
+        } else if (auto found = lookup()) {
+            runs = std::move(*found);
+        }
+
+        search.cancel();
+
+        auto scan = std::make_shared<Scan>(lines, search.query, search.pattern, std::move(runs), complete ? &known : nullptr, -1);
+
+        scan->replacement = search.replacement;
+
+        if (scan->blocks() > 1)
+            pool.run(scan);
+
+        scan->work();
+        scan->wait();
+
+        // the workers are done with the snapshot; letting it go now spares
+        // the edits below from copying what it shares
+        scan->lines = {};
+
+        std::vector<History::Piece> pieces;
+        std::string removed;
+        std::string inserted;
+        std::size_t taken = 0;
+
+        for (std::size_t b = 0; b < scan->blocks(); ++b) {
+            taken += scan->taken[b].size();
+            pieces.insert(pieces.end(), scan->pieces[b].begin(), scan->pieces[b].end());
+        }
+
+        bool regex = search.regex;
+
+        stop_search();
+        search.regex = regex;
+        cursors.clear();
+
+        if (pieces.empty())
+            return;
+
+        removed.reserve(taken);
+        inserted.reserve(pieces.size() * scan->replacement->size());
+
+        for (std::size_t b = 0; b < scan->blocks(); ++b) {
+            removed += scan->taken[b];
+
+            for (std::size_t k = 0; k < scan->results[b].size(); ++k) {
+                int at = scan->results[b][k];
+
+                lines.text(at) = std::move(scan->rewritten[b][k]);
+                touch(at);
+            }
+        }
+
+        for (std::size_t k = 0; k < pieces.size(); ++k)
+            inserted += *scan->replacement;
+
+        int after = std::min(column, static_cast<int>(lines[line].size()));
+        History::Header h = {pieces.front().line, pieces.front().column, static_cast<std::uint32_t>(line), static_cast<std::uint32_t>(column),
+            static_cast<std::uint32_t>(line), static_cast<std::uint32_t>(after), 0, 0, 0};
+
+        history.record(h, removed, inserted, pieces);
+        column = after;
+        refresh();
+    }
+
+    // sorted runs of lines reordered to start at the search's origin and
+    // wrap around
+    auto from_origin(std::vector<std::pair<int, int>> runs) const -> std::vector<std::pair<int, int>> {
+        std::vector<std::pair<int, int>> after;
+        std::vector<std::pair<int, int>> before;
+        int origin = search.origin_line;
+
+        for (auto [first, last]: runs) {
+            if (last <= origin) {
+                before.push_back({first, last});
+            } else if (first >= origin) {
+                after.push_back({first, last});
+            } else {
+                after.push_back({origin, last});
+                before.push_back({first, origin});
+            }
+        }
+
+        after.insert(after.end(), before.begin(), before.end());
+
+        return after;
+    }
+
+    // takes in what background work finished since the last call, and
+    // moves the cursor if it was waiting for a match
+    auto gather() -> void {
+        adopt();
+
+        if (!search.collect())
+            return;
+
+        if (!search.placed)
+            jump();
+
+        if (search.placed && search.step != 0)
+            next_match(std::exchange(search.step, 0));
+    }
+
+    // moves to the first match at or after where the search started, or
+    // waits for the scan to find one
+    auto jump() -> void {
+        line = search.origin_line;
+        column = search.origin_column;
+        search.placed = true;
+
+        if (search.query.empty())
+            return;
+
+        auto& found = search.found.back().lines;
+
+        for (std::size_t k = 0; k < found.size() && k < 2; ++k) {
+            std::size_t at = search.first(lines[found[k]], found[k] == line ? column : 0).first;
+
+            if (at != std::string_view::npos) {
+                line = found[k];
+                column = at;
+                return;
+            }
+        }
+
+        if (search.scan)
+            search.placed = false;
+        else if (!found.empty())
+            column = search.first(lines[line], 0).first;
+    }
+
+    // the next or previous match from the cursor, wrapping around once
+    // the scan is complete
+    auto next_match(int direction) -> void {
+        if (search.query.empty() || !search.error.empty())
+            return;
+
+        auto& found = search.found.back().lines;
+        int size = lines.size();
+        auto earlier = [&](int a, int b) {
+            return (a - search.origin_line + size) % size < (b - search.origin_line + size) % size;
+        };
+        std::string_view text = lines[line];
+
+        // steps from the first match, once the scan has found it
+        if (!search.placed) {
+            search.step = direction;
+            return;
+        }
+
+        // past the cursor's line, a line the scan hasn't reached yet, or a
+        // wrap-around before it is complete, leaves the step for gather()
+        // to take once the scan gets there
+        if (direction > 0) {
+            if (std::size_t at = search.first(text, column + 1).first; at != std::string_view::npos) {
+                column = at;
+                return;
+            }
+
+            auto it = std::upper_bound(found.begin(), found.end(), line, earlier);
+
+            if (it == found.end() && search.scan) {
+                search.step = direction;
+                return;
+            }
+
+            if (found.empty())
+                return;
+
+            line = it == found.end() ? found.front() : *it;
+            column = search.first(lines[line], 0).first;
+            return;
+        }
+
+        if (std::size_t at = search.last(text, column).first; at != std::string_view::npos) {
+            column = at;
+            return;
+        }
+
+        auto it = std::lower_bound(found.begin(), found.end(), line, earlier);
+
+        if (it == found.begin() && search.scan) {
+            search.step = direction;
+            return;
+        }
+
+        if (found.empty())
+            return;
+
+        line = it == found.begin() ? found.back() : *std::prev(it);
+        column = search.last(lines[line], std::string_view::npos).first;
+    }
+
+    // matches of the query within the rows on screen, `width` cells wide,
+    // and the cursors besides the primary one; `current` marks the match
+    // that one is on. A cursor past the end of its row gets a blank to
+    // show it on.
+    auto highlights(std::vector<std::string>& rows, int width, std::vector<Highlight>& out) -> void {
+        out.clear();
+
+        for (auto [l, col]: cursors) {
+            auto [cx, cy] = place(l, col);
+
+            if (cy < 0 || cy >= static_cast<int>(rows.size()) || cx < 0 || cx >= width)
+                continue;
+
+            auto& row = rows[cy];
+            int i = 0;
+
+            for (int cell = 0; i < static_cast<int>(row.size()) && cell < cx; i = next_grapheme(row, i))
+                cell += cell_width(row, i, cell, tab_width);
+
+            if (i == static_cast<int>(row.size()))
+                row.append(cx - measure(row) + 1, ' ');
+
+            out.push_back(Highlight{cy, i, next_grapheme(row, i), false});
+        }
+
+        if (search.active && !search.query.empty() && search.error.empty())
+            matches_on_screen(rows.size(), width, out);
+
+        // in row order without overlaps, for drawing
+        if (!cursors.empty()) {
+            std::ranges::sort(out, {}, [](auto& h) { return std::pair{h.row, h.first}; });
+
+            for (std::size_t k = 1; k < out.size(); ++k)
+                if (out[k].row == out[k - 1].row && out[k].first < out[k - 1].last)
+                    out.erase(out.begin() + k--);
+        }
+    }
+
+    // matches are found on the whole line, so that anchors hold and those
+    // crossing a wrap point or the horizontal clip are kept, then mapped
+    // onto the bytes of the `count` rows on screen that show them
+    auto matches_on_screen(int count, int width, std::vector<Highlight>& out) -> void {
+        // each match of `text` that starts before byte `end`; empty ones
+        // aren't drawn, but the search goes on past them
+        auto each = [&](std::string_view text, int end, auto&& mark) {
+            for (auto [at, length] = search.first(text, 0); at != std::string_view::npos && at < static_cast<std::size_t>(end);
+                 std::tie(at, length) = search.first(text, at + std::max<std::size_t>(length, 1))) {
+                if (length > 0)
+                    mark(static_cast<int>(at), static_cast<int>(at + length));
+            }
+        };
+
+        if (!wrap) {
+            for (int row = 0; row < count; ++row) {
+                int l = line_offset + row;
+                std::string_view text = lines[l];
+                auto [i, cell] = columns.find(text, lines.version(l), column_offset);
+                int end = columns.byte_at(text, lines.version(l), column_offset + width);
+
+                each(text, end, [&](int from, int to) {
+                    int first = expanded_size(text, i, cell, column_offset, column_offset + width, tab_width, from);
+                    int last = expanded_size(text, i, cell, column_offset, column_offset + width, tab_width, to);
+
+                    if (last > first)
+                        out.push_back(Highlight{row, first, last, l == line && from == column});
+                });
+            }
+
+            return;
+        }
+
+        for (int l = line_offset, row = 0, skip = row_offset; l < static_cast<int>(lines.size()) && row < count; ++l, skip = 0) {
+            auto& points = layout.breaks(lines[l], lines.version(l));
+            std::string_view text = lines[l];
+            int shown = std::min(static_cast<int>(points.size()) - skip, count - row);
+            auto start = [&](int k) { return k < static_cast<int>(points.size()) ? points[k] : static_cast<int>(text.size()); };
+
+            each(text, start(skip + shown), [&](int from, int to) {
+                int k = std::max(skip, static_cast<int>(std::upper_bound(points.begin(), points.end(), from) - points.begin()) - 1);
+
+                for (; k < skip + shown && start(k) < to; ++k) {
+                    std::string_view segment = text.substr(start(k), start(k + 1) - start(k));
+                    int first = expanded_size(segment, 0, 0, 0, width, tab_width, std::max(from - start(k), 0));
+                    int last = expanded_size(segment, 0, 0, 0, width, tab_width, to - start(k));
+
+                    if (last > first)
+                        out.push_back(Highlight{row + k - skip, first, last, l == line && from == column});
+                }
+            });
+
+            row += shown;
+        }
+    }
+
+    // 0-based screen position of the cursor, valid after adjust_offset
+    auto cursor() -> std::pair<int, int> {
+        return place(line, column);
+    }
+
+    // where on screen the position (at, byte) is, which may be off it
+    auto place(int at, int byte) -> std::pair<int, int> {
+        if (wrap) {
+            auto [row, x] = layout.locate(lines[at], lines.version(at), byte);
+
+            return {x, layout.row_of(at) + row - layout.row_of(line_offset) - row_offset};
+        }
+
+        return {columns.cells(lines[at], lines.version(at), byte) - column_offset, at - line_offset};
+    }
+
+    auto visible_rows(int height, int width, std::vector<std::string>& rows) -> void {
+        int count = 0;
+
+        auto next_row = [&]() -> std::string& {
+            if (count == static_cast<int>(rows.size()))
+                rows.emplace_back();
+
+            rows[count].clear();
+
+            return rows[count++];
+        };
+
+        if (!wrap) {
+            for (int i = line_offset; i < static_cast<int>(lines.size()) && count < height; ++i)
+                columns.expand(lines[i], lines.version(i), column_offset, width, next_row());
+
+            rows.resize(count);
+            return;
+        }
+
+        int row = row_offset;
+
+        for (int i = line_offset; i < static_cast<int>(lines.size()) && count < height; ++i) {
+            auto& points = layout.breaks(lines[i], lines.version(i));
+            std::string_view text = lines[i];
+
+            for (; row < static_cast<int>(points.size()) && count < height; ++row) {
+                int end = row + 1 < static_cast<int>(points.size()) ? points[row + 1] : text.size();
+
+                expand(text.substr(points[row], end - points[row]), 0, 0, 0, width, tab_width, next_row());
+            }
+
+            row = 0;
+        }
+
+        rows.resize(count);
+    }
+};
+
+// In-memory terminal for headless runs: interprets the escape sequences
+// Tui emits and keeps the resulting grid of cells.
+struct Screen {
+    int columns;
+    int rows;
+    std::vector<std::string> cells;
+    int x = 0;
+    int y = 0;
+
+    Screen(int columns, int rows) : columns(columns), rows(rows), cells(columns * rows, " ") {}
+
+    auto new_line() -> void {
+        x = 0;
+
+        if (++y < rows)
+            return;
+
+        std::move(cells.begin() + columns, cells.end(), cells.begin());
+        std::fill(cells.end() - columns, cells.end(), " ");
+        y = rows - 1;
+    }
+
+    auto put(std::string_view grapheme, int width) -> void {
+        if (x + width > columns)
+            new_line();
+
+        cells[y * columns + x] = grapheme;
+
+        if (width == 2 && x + 1 < columns)
+            cells[y * columns + x + 1].clear();
+
+        x = std::min(x + width, columns - 1);
+    }
+
+    auto control(std::string_view parameters, char final) -> void {
+        if (final == 'H') {
+            int row = 1;
+            int column = 1;
+            auto separator = parameters.find(';');
+
+            std::from_chars(parameters.data(), parameters.data() + std::min(separator, parameters.size()), row);
+
+            if (separator != std::string_view::npos)
+                std::from_chars(parameters.data() + separator + 1, parameters.data() + parameters.size(), column);
+
+            y = std::clamp(row - 1, 0, rows - 1);
+            x = std::clamp(column - 1, 0, columns - 1);
+        } else if (final == 'J' && parameters == "2") {
+            std::fill(cells.begin(), cells.end(), " ");
+        }
+    }
+
+    auto feed(std::string_view bytes) -> void {
+        int size = bytes.size();
+
+        for (int i = 0; i < size;) {
+            if (bytes[i] == '\033' && i + 1 < size && bytes[i + 1] == '[') {
+                int end = i + 2;
+
+                while (end < size && (bytes[end] < 0x40 || bytes[end] > 0x7E))
+                    ++end;
+
+                if (end < size)
+                    control(bytes.substr(i + 2, end - i - 2), bytes[end]);
+
+                i = end + 1;
+            } else if (bytes[i] == '\r') {
+                x = 0;
+                ++i;
+            } else if (bytes[i] == '\n') {
+                new_line();
+                ++i;
+            } else {
+                int next = next_grapheme(bytes, i);
+
+                put(bytes.substr(i, next - i), cell_width(bytes, i, x, 8));
+                i = next;
+            }
+        }
+    }
+
+    auto dump() -> std::string {
+        std::string text;
+
+        for (int row = 0; row < rows; ++row) {
+            std::string line;
+
+            for (int column = 0; column < columns; ++column)
+                line += cells[row * columns + column];
+
+            line.erase(line.find_last_not_of(' ') + 1);
+            text += line;
+            text += '\n';
+        }
+
+        return text;
+    }
+};
+
+struct Tui {
+    struct termios term;
+    std::vector<std::string> back_buffer;
+    std::string out;
+    std::optional<Screen> screen;
+    // counters for the stats dump, kept by whichever thread draws
+    std::atomic<std::size_t> written = 0;
+    std::atomic<std::uint64_t> writes = 0;
+    std::atomic<std::uint64_t> frames = 0;
+    std::atomic<std::int64_t> drawing = 0;
+    std::atomic<std::size_t> held = 0;
+    std::atomic<int> columns = 80;
+    std::atomic<int> rows = 24;
+    int last_width = 0;
+    int last_height = 0;
+    bool synchronized = false;
+    std::string typeahead;
+
+    Tui() {
+        resize();
+
+        tcgetattr(STDIN_FILENO, &term);
+        term.c_lflag &= ~(ECHO | ICANON);
+        tcsetattr(STDIN_FILENO, TCSANOW, &term);
+
+        synchronized = query_synchronized();
+
+        out += "\033[?2004h";
+        flush();
+    }
+
+    // headless: frames go to an in-memory screen and the terminal is
+    // never touched
+    Tui(int columns, int rows) : screen(std::in_place, columns, rows), columns(columns), rows(rows) {}
+
+    ~Tui() {
+        if (screen)
+            return;
+
+        out += "\033[?2004l";
+        flush();
+
+        tcgetattr(STDIN_FILENO, &term);
+        term.c_lflag |= (ECHO | ICANON);
+        tcsetattr(STDIN_FILENO, TCSANOW, &term);
+    }
+
+    // DECRQM for mode 2026 followed by DA1: every terminal answers DA1, so
+    // its reply ends the wait early on terminals that ignore DECRQM. Keys
+    // typed meanwhile arrive mixed with the replies and are kept in
+    // `typeahead` for the input loop.
+    auto query_synchronized(std::chrono::milliseconds timeout = std::chrono::milliseconds{100}) -> bool {
+        if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO))
+            return false;
+
+        std::string_view query = "\033[?2026$p\033[c";
+
+        if (write(STDOUT_FILENO, query.data(), query.size()) != static_cast<ssize_t>(query.size()))
+            return false;
+
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+
+        while (!take_reply(typeahead, "c")) {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+
+            struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+
+            if (remaining.count() <= 0 || poll(&fd, 1, remaining.count()) <= 0)
+                break;
+
+            char chunk[64];
+            ssize_t n = read(STDIN_FILENO, chunk, sizeof(chunk));
+
+            if (n <= 0)
+                break;
+
+            typeahead.append(chunk, n);
+        }
+
+        // 1 and 2 are set and reset, 3 is permanently set
+        auto mode = take_reply(typeahead, "$y");
+
+        return mode == "2026;1" || mode == "2026;2" || mode == "2026;3";
+    }
+
+    // removes the first `ESC [ ? params final` reply from `input` and
+    // returns its parameters
+    static auto take_reply(std::string& input, std::string_view final) -> std::optional<std::string> {
+        for (std::size_t at = input.find("\033[?"); at != std::string::npos; at = input.find("\033[?", at + 1)) {
+            std::size_t end = input.find_first_not_of("0123456789;", at + 3);
+
+            if (end != std::string::npos && input.compare(end, final.size(), final) == 0) {
+                std::string params = input.substr(at + 3, end - at - 3);
+
+                input.erase(at, end + final.size() - at);
+                return params;
+            }
+        }
+
+        return std::nullopt;
+    }
+
+    auto flush() -> void {
+        written.fetch_add(out.size(), std::memory_order_relaxed);
+
+        if (screen) {
+            screen->feed(out);
+            out.clear();
+            return;
+        }
+
+        for (std::size_t done = 0; done < out.size();) {
+            ssize_t n = write(STDOUT_FILENO, out.data() + done, out.size() - done);
+
+            writes.fetch_add(1, std::memory_order_relaxed);
+
+            if (n < 0 && errno == EINTR)
+                continue;
+
+            if (n <= 0)
+                break;
+
+            done += n;
+        }
+
+        out.clear();
+    }
+
+    auto clear() -> void {
+        out += "\033[2J";
+        back_buffer.clear();
+    }
+
+    auto begin_frame() -> void {
+        if (synchronized)
+            out += "\033[?2026h";
+    }
+
+    auto end_frame() -> void {
+        if (synchronized)
+            out += "\033[?2026l";
+    }
+
+    auto append_number(int n) -> void {
+        char digits[16];
+        auto end = std::to_chars(digits, digits + sizeof(digits), n).ptr;
+
+        out.append(digits, end);
+    }
+
+    auto move_cursor(int x, int y) -> void {
+        out += "\033[";
+        append_number(y);
+        out += ';';
+        append_number(x);
+        out += 'H';
+    }
+
+    // called on startup and on SIGWINCH; frames read the cached size
+    auto resize() -> void {
+        struct winsize w = {24, 80, 0, 0};
+        ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+
+        columns = w.ws_col;
+        rows = w.ws_row;
+    }
+
+    auto width() -> int {
+        return columns - 1;
+    }
+
+    auto height() -> int {
+        return rows - 1;
+    }
+
+    auto display(std::vector<std::string> const& rows, std::span<Highlight const> highlights = {}) -> void {
+        TRACE("display");
+
+        move_cursor(1, 1);
+
+        int count = rows.size();
+
+        for (int i = 0; i < count; ++i) {
+            auto& line = rows[i];
+            int written = 0;
+
+            for (; !highlights.empty() && highlights.front().row == i; highlights = highlights.subspan(1)) {
+                auto& h = highlights.front();
+
+                out.append(line, written, h.first - written);
+                out += h.current ? "\033[30;43m" : "\033[7m";
+                out.append(line, h.first, h.last - h.first);
+                out += "\033[m";
+                written = h.last;
+            }
+
+            out.append(line, written);
+
+            if (i < static_cast<int>(back_buffer.size())) {
+                auto& back_buffer_line = back_buffer[i];
+
+                int cells = measure(line);
+                int back_buffer_cells = measure(back_buffer_line);
+
+                if (cells < back_buffer_cells)
+                    out.append(back_buffer_cells - cells, ' ');
+            }
+
+            out += '\n';
+        }
+
+        // rows the last frame had and this one doesn't, like the search
+        // prompt once it closes
+        for (int i = count; i < static_cast<int>(back_buffer.size()); ++i) {
+            out.append(measure(back_buffer[i]), ' ');
+            out += '\n';
+        }
+    }
+
+    auto setup_back_buffer(std::vector<std::string> const& rows) -> void {
+        TRACE("setup_back_buffer");
+
+        std::size_t bytes = out.capacity() + rows.size() * sizeof(std::string);
+
+        // assigning into the previous frame's rows reuses their storage
+        back_buffer.resize(rows.size());
+
+        for (std::size_t i = 0; i < rows.size(); ++i) {
+            back_buffer[i].assign(rows[i]);
+            bytes += back_buffer[i].capacity();
+        }
+
+        held.store(bytes, std::memory_order_relaxed);
+    }
+};
+
+struct Event {
+    enum Kind { key, paste, resize, changed, closed, stats, found };
+
+    Kind kind = key;
+    char c = 0;
+    std::string text;
+    std::chrono::steady_clock::time_point time = std::chrono::steady_clock::now();
+
+    Event() = default;
+    Event(Kind kind, char c = 0) : kind(kind), c(c) {}
+    Event(Kind kind, std::string text) : kind(kind), text(std::move(text)) {}
+};
+
+// Recorded input: a header, then one record per key or paste applied to
+// the editor with its time since the session started.
+struct Recording {
+    static constexpr std::string_view magic = "epp recording 1\n";
+
+    static auto write(std::ostream& out, Event const& event, std::chrono::steady_clock::time_point start) -> void {
+        std::int64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(event.time - start).count();
+        std::uint8_t kind = event.kind;
+        std::uint32_t size = event.kind == Event::key ? 1 : event.text.size();
+
+        out.write(reinterpret_cast<char const *>(&micros), sizeof(micros));
+        out.write(reinterpret_cast<char const *>(&kind), sizeof(kind));
+        out.write(reinterpret_cast<char const *>(&size), sizeof(size));
+
+        if (event.kind == Event::key)
+            out.put(event.c);
+        else
+            out.write(event.text.data(), size);
+    }
+
+    static auto read(std::istream& in, Event& event, std::chrono::microseconds& offset) -> bool {
+        std::int64_t micros;
+        std::uint8_t kind;
+        std::uint32_t size;
+
+        in.read(reinterpret_cast<char *>(&micros), sizeof(micros));
+        in.read(reinterpret_cast<char *>(&kind), sizeof(kind));
+        in.read(reinterpret_cast<char *>(&size), sizeof(size));
+
+        if (!in || (kind != Event::key && kind != Event::paste) || (kind == Event::key && size != 1))
+            return false;
+
+        event.kind = static_cast<Event::Kind>(kind);
+        event.text.clear();
+
+        if (event.kind == Event::key)
+            event.c = static_cast<char>(in.get());
+
+        // a corrupt size can claim up to 4 GB, so the text grows only as
+        // far as the file actually goes
+        for (std::size_t done = 0; event.kind == Event::paste && done < size && in;) {
+            std::size_t n = std::min<std::size_t>(size - done, 1 << 16);
+
+            event.text.resize(done + n);
+            in.read(event.text.data() + done, n);
+            done += n;
+        }
+
+        offset = std::chrono::microseconds{micros};
+
+        return static_cast<bool>(in);
+    }
+};
+
+// Splits raw terminal input into key events and bracketed pastes, which
+// arrive whole as a single event.
+struct Decoder {
+    static constexpr std::string_view paste_start = "\033[200~";
+    static constexpr std::string_view paste_end = "\033[201~";
+
+    std::string pending;
+    std::string pasted;
+    bool pasting = false;
+
+    auto feed(std::string_view chunk, auto&& emit) -> void {
+        while (!chunk.empty()) {
+            if (pasting) {
+                std::size_t start = pasted.size() - std::min(pasted.size(), paste_end.size() - 1);
+
+                pasted.append(chunk);
+                chunk = {};
+
+                if (std::size_t end = pasted.find(paste_end, start); end != std::string::npos) {
+                    std::string rest = pasted.substr(end + paste_end.size());
+
+                    pasted.resize(end);
+                    emit(Event{Event::paste, std::move(pasted)});
+                    pasted.clear();
+                    pasting = false;
+                    feed(rest, emit);
+                }
+
+                return;
+            }
+
+            if (pending.empty() && chunk.front() != '\033') {
+                std::size_t end = std::min(chunk.find('\033'), chunk.size());
+
+                for (char c: chunk.substr(0, end))
+                    emit(Event{Event::key, c});
+
+                chunk.remove_prefix(end);
+                continue;
+            }
+
+            pending.push_back(chunk.front());
+            chunk.remove_prefix(1);
+
+            if (pending == paste_start) {
+                pending.clear();
+                pasting = true;
+            } else if (!paste_start.starts_with(pending)) {
+                flush(emit);
+            }
+        }
+    }
+
+    // gives up on a partial escape sequence, e.g. a lone Escape key
+    auto flush(auto&& emit) -> void {
+        for (char c: pending)
+            emit(Event{Event::key, c});
+
+        pending.clear();
+    }
+};
+
+// Lock-free single producer, single consumer ring. Producers block when
+// it is full instead of dropping input.
+template <typename T, std::uint32_t N>
+struct Queue {
+    static_assert((N & (N - 1)) == 0);
+
+    std::array<T, N> slots;
+    alignas(64) std::atomic<std::uint32_t> head = 0;
+    alignas(64) std::atomic<std::uint32_t> tail = 0;
+
+    auto push(T value) -> void {
+        std::uint32_t t = tail.load(std::memory_order_relaxed);
+
+        for (std::uint32_t h = head.load(std::memory_order_acquire); t - h == N; h = head.load(std::memory_order_acquire))
+            head.wait(h, std::memory_order_acquire);
+
+        slots[t % N] = std::move(value);
+        tail.store(t + 1, std::memory_order_release);
+        tail.notify_one();
+    }
+
+    // for producers that must never block: false when the queue is full
+    auto try_push(T value) -> bool {
+        std::uint32_t t = tail.load(std::memory_order_relaxed);
+
+        if (t - head.load(std::memory_order_acquire) == N)
+            return false;
+
+        slots[t % N] = std::move(value);
+        tail.store(t + 1, std::memory_order_release);
+        tail.notify_one();
+
+        return true;
+    }
+
+    auto pop(T& value) -> bool {
+        std::uint32_t h = head.load(std::memory_order_relaxed);
+
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+
+        value = std::move(slots[h % N]);
+        head.store(h + 1, std::memory_order_release);
+        head.notify_one();
+
+        return true;
+    }
+
+    auto wait() -> void {
+        std::uint32_t h = head.load(std::memory_order_relaxed);
+
+        for (std::uint32_t t = tail.load(std::memory_order_acquire); t == h; t = tail.load(std::memory_order_acquire))
+            tail.wait(t, std::memory_order_acquire);
+    }
+};
+
+struct Frame {
+    std::vector<std::string> rows;
+    std::vector<Highlight> highlights;
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+    std::uint64_t sequence = 0;
+};
+
+// Triple buffer handing the newest frame from the editor to the renderer:
+// the editor never waits, and the renderer skips frames it was too slow
+// to draw.
+struct Frames {
+    static constexpr int fresh = 4;
+
+    std::array<Frame, 3> slots;
+    std::atomic<int> middle = 1;
+    int back = 0;
+    int front = 2;
+
+    auto draft() -> Frame& {
+        return slots[back];
+    }
+
+    auto publish() -> void {
+        back = middle.exchange(back | fresh, std::memory_order_acq_rel) & ~fresh;
+        middle.notify_one();
+    }
+
+    auto latest() -> Frame& {
+        int m = middle.load(std::memory_order_acquire);
+
+        while (!(m & fresh)) {
+            middle.wait(m, std::memory_order_acquire);
+            m = middle.load(std::memory_order_acquire);
+        }
+
+        front = middle.exchange(front, std::memory_order_acq_rel) & ~fresh;
+
+        return slots[front];
+    }
+};
+
+// Log-linear histogram in the spirit of HdrHistogram: exact below 16,
+// then 16 buckets per power of two, so every bucket is within 6% of the
+// values it holds.
+struct Histogram {
+    static constexpr int sub_bits = 4;
+    static constexpr int sub_count = 1 << sub_bits;
+
+    std::array<std::uint64_t, 64 * sub_count> counts = {};
+    std::uint64_t total = 0;
+    std::uint64_t max = 0;
+
+    static auto bucket(std::uint64_t value) -> int {
+        if (value < sub_count)
+            return value;
+
+        int shift = std::bit_width(value) - 1 - sub_bits;
+
+        return (shift + 1) * sub_count + (value >> shift) - sub_count;
+    }
+
+    // the largest value that lands in bucket `index`
+    static auto highest(int index) -> std::uint64_t {
+        if (index < sub_count)
+            return index;
+
+        int shift = index / sub_count - 1;
+
+        return ((static_cast<std::uint64_t>(index % sub_count + sub_count + 1)) << shift) - 1;
+    }
+
+    auto record(std::uint64_t value) -> void {
+        ++counts[bucket(value)];
+        ++total;
+        max = std::max(max, value);
+    }
+
+    auto percentile(double p) const -> std::uint64_t {
+        std::uint64_t wanted = std::max<std::uint64_t>(1, std::ceil(p * total));
+        std::uint64_t seen = 0;
+
+        for (std::size_t i = 0; i < counts.size(); ++i) {
+            seen += counts[i];
+
+            if (seen >= wanted)
+                return std::min(max, highest(i));
+        }
+
+        return max;
+    }
+};
+
+// Per-keystroke latency from the moment input was read to the moment the
+// frame showing its effect was flushed. The editor tags each sample with
+// the sequence number of the frame it publishes next; the renderer files
+// every sample up to the frame it just drew, which also covers frames it
+// skipped.
+struct Latency {
+    static constexpr std::array<std::string_view, 8> kinds = {"insert", "delete", "motion", "newline", "save", "paste", "undo", "search"};
+
+    struct Sample {
+        int kind = 0;
+        std::uint64_t sequence = 0;
+        std::chrono::steady_clock::time_point time;
+    };
+
+    Queue<Sample, 4096> pending;
+    std::array<Histogram, kinds.size()> histograms;
+    Sample held;
+    bool holding = false;
+    std::uint64_t dropped = 0;
+
+    // index into kinds, or -1 for events that aren't keystrokes; what a
+    // key does depends on the mode the editor was in when it came, and in
+    // the search prompt every key and paste edits or moves the search
+    static auto classify(Event const& event, bool searching) -> int {
+        if (event.kind != Event::key && event.kind != Event::paste)
+            return -1;
+
+        if (searching)
+            return 7;
+
+        if (event.kind == Event::paste)
+            return 5;
+
+        switch (event.c) {
+        case '\n':
+        case 'O':
+            return 3;
+        case 'S':
+            return 4;
+        case 'U':
+        case 'R':
+            return 6;
+        case 'I':
+            return 7;
+        case '\b':
+        case 127:
+        case 'K':
+            return 1;
+        case 'Q':
+            return -1;
+        case 'B': case 'F': case 'N': case 'P': case 'A': case 'E': case 'V': case 'C':
+        // the mark and extra cursors only place cursors, like a motion
+        case 'M': case 'Y': case '\033':
+            return 2;
+        default:
+            return 0;
+        }
+    }
+
+    // editor side: never blocks, a full queue only loses the sample
+    auto sample(Event const& event, bool searching, std::uint64_t sequence) -> void {
+        int kind = classify(event, searching);
+
+        if (kind >= 0 && !pending.try_push(Sample{kind, sequence, event.time}))
+            ++dropped;
+    }
+
+    // renderer side, after frame `sequence` has been flushed
+    auto settle(std::uint64_t sequence) -> void {
+        auto now = std::chrono::steady_clock::now();
+
+        while (holding || pending.pop(held)) {
+            if (held.sequence > sequence) {
+                holding = true;
+                return;
+            }
+
+            holding = false;
+            histograms[held.kind].record(std::chrono::duration_cast<std::chrono::microseconds>(now - held.time).count());
+        }
+    }
+
+    auto report(std::FILE *out) const -> void {
+        std::println(out, "{:<8} {:>8} {:>9} {:>9} {:>9} {:>9} {:>9}  (us)", "kind", "count", "p50", "p90", "p99", "p99.9", "max");
+
+        for (std::size_t k = 0; k < kinds.size(); ++k) {
+            auto& h = histograms[k];
+
+            if (h.total > 0)
+                std::println(out, "{:<8} {:>8} {:>9} {:>9} {:>9} {:>9} {:>9}", kinds[k], h.total,
+                    h.percentile(0.5), h.percentile(0.9), h.percentile(0.99), h.percentile(0.999), h.max);
+        }
+
+        if (dropped > 0)
+            std::println(out, "{} samples dropped", dropped);
+
+        for (std::size_t k = 0; k < kinds.size(); ++k) {
+            auto& h = histograms[k];
+
+            if (h.total == 0)
+                continue;
+
+            std::println(out, "\n{}: value (us, at most)  count  cumulative", kinds[k]);
+
+            std::uint64_t seen = 0;
+
+            for (std::size_t i = 0; i < h.counts.size(); ++i) {
+                if (h.counts[i] == 0)
+                    continue;
+
+                seen += h.counts[i];
+                std::println(out, "{:>12} {:>8} {:>10.4f}", Histogram::highest(i), h.counts[i], static_cast<double>(seen) / h.total);
+            }
+        }
+    }
+};
+
+inline auto compose(Editor& editor, Tui& tui, Frame& frame) -> void {
+    TRACE("compose");
+
+    // searching takes the last row for the query
+    int height = tui.height() - (editor.search.active ? 1 : 0);
+
+    editor.adjust_offset(height, tui.width());
+    editor.visible_rows(height, tui.width(), frame.rows);
+    std::tie(frame.x, frame.y) = editor.cursor();
+    editor.highlights(frame.rows, tui.width(), frame.highlights);
+    frame.width = tui.width();
+    frame.height = tui.height();
+
+    if (editor.search.active) {
+        auto& search = editor.search;
+
+        frame.rows.resize(height);
+        frame.rows.emplace_back(search.regex ? "regex: " : "search: ");
+        frame.rows.back() += search.query;
+
+        if (search.replacing)
+            frame.rows.back() += "  with: " + search.replacement;
+
+        frame.x = measure(frame.rows.back());
+        frame.y = height;
+
+        if (!search.error.empty())
+            frame.rows.back() += "  [" + search.error + "]";
+        else if (search.scan)
+            frame.rows.back() += "  [" + std::to_string(search.matches()) + " lines so far]";
+        else if (!search.query.empty())
+            frame.rows.back() += search.matches() > 0 ? "  [" + std::to_string(search.matches()) + " lines]" : "  [no match]";
+    }
+}
+
+inline auto draw(Tui& tui, Frame const& frame) -> void {
+    TRACE("draw");
+
+    auto start = std::chrono::steady_clock::now();
+
+    if (frame.width != tui.last_width || frame.height != tui.last_height) {
+        tui.clear();
+        tui.last_width = frame.width;
+        tui.last_height = frame.height;
+    }
+
+    tui.begin_frame();
+    tui.display(frame.rows, frame.highlights);
+    tui.move_cursor(frame.x + 1, frame.y + 1);
+    tui.end_frame();
+    tui.flush();
+    tui.setup_back_buffer(frame.rows);
+
+    tui.frames.fetch_add(1, std::memory_order_relaxed);
+    tui.drawing.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+}
+
+inline auto apply(Editor& editor, Event const& event) -> void {
+    switch (event.kind) {
+    case Event::key:
+        editor.input(event.c);
+        break;
+    case Event::paste:
+        editor.paste(event.text);
+        break;
+    case Event::changed:
+        editor.revert();
+        break;
+    case Event::closed:
+        editor.running = false;
+        break;
+    case Event::found:
+        editor.gather();
+        break;
+    case Event::resize:
+    case Event::stats:
+        break;
+    }
+}
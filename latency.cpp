@@ -0,0 +1,292 @@
+// End-to-end latency of a running epp, measured from the terminal's side:
+// epp runs on a pseudo-terminal, scripted keys go in, and a keystroke is
+// done once the frame it caused has been completely written.
+//
+//     c++ -std=c++23 -O2 latency.cpp -o epp-latency
+//     ./epp-latency [-e ./epp] [-n keys]
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <poll.h>
+#include <print>
+#include <signal.h>
+#include <string>
+#include <string_view>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+using clock_type = std::chrono::steady_clock;
+
+// epp only brackets frames with synchronized output when the terminal says
+// it supports mode 2026, so the harness claims to; the end marker is then
+// how it knows a frame is complete
+constexpr std::string_view query = "\033[?2026$p";
+constexpr std::string_view reply = "\033[?2026;2$y\033[?62;c";
+constexpr std::string_view frame_end = "\033[?2026l";
+
+// A scratch directory epp keeps its state in, the undo history it spills
+// and its search indexes, instead of the operator's; removed at exit
+struct State {
+    std::string directory;
+
+    State() {
+        char name[] = "/tmp/epp-latency-state-XXXXXX";
+
+        if (mkdtemp(name))
+            directory = name;
+    }
+
+    ~State() {
+        std::error_code error;
+
+        if (!directory.empty())
+            std::filesystem::remove_all(directory, error);
+    }
+};
+
+struct Session {
+    pid_t pid = -1;
+    int master = -1;
+    std::string pending;
+
+    Session(const char *program, const char *file, const char *state, int columns, int rows) {
+        master = posix_openpt(O_RDWR | O_NOCTTY);
+
+        if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+            return;
+
+        struct winsize size = {static_cast<unsigned short>(rows), static_cast<unsigned short>(columns), 0, 0};
+        std::string slave = ptsname(master);
+
+        pid = fork();
+
+        if (pid == 0) {
+            setsid();
+
+            int fd = open(slave.c_str(), O_RDWR);
+
+            ioctl(fd, TIOCSCTTY, 0);
+            ioctl(fd, TIOCSWINSZ, &size);
+
+            for (int target: {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO})
+                dup2(fd, target);
+
+            close(fd);
+            close(master);
+            setenv("XDG_STATE_HOME", state, 1);
+            execl(program, program, file, static_cast<char *>(nullptr));
+            _exit(127);
+        }
+    }
+
+    ~Session() {
+        if (pid > 0) {
+            kill(pid, SIGKILL);
+            waitpid(pid, nullptr, 0);
+        }
+
+        if (master >= 0)
+            close(master);
+    }
+
+    auto send(std::string_view keys) -> void {
+        if (write(master, keys.data(), keys.size()) != static_cast<ssize_t>(keys.size()))
+            std::println(stderr, "short write to the terminal");
+    }
+
+    // reads until a whole frame has arrived, answering the mode query on
+    // the way; false on timeout or when epp went away
+    auto wait_frame(std::chrono::milliseconds timeout = std::chrono::milliseconds{5000}) -> bool {
+        auto deadline = clock_type::now() + timeout;
+        std::array<char, 65536> chunk;
+
+        while (true) {
+            if (auto at = pending.find(query); at != std::string::npos) {
+                send(reply);
+                pending.erase(0, at + query.size());
+            }
+
+            if (auto at = pending.find(frame_end); at != std::string::npos) {
+                pending.erase(0, at + frame_end.size());
+                return true;
+            }
+
+            // keep enough of the tail that a marker split across reads
+            // is still found
+            if (pending.size() > query.size())
+                pending.erase(0, pending.size() - query.size());
+
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clock_type::now());
+            struct pollfd fd = {master, POLLIN, 0};
+
+            if (remaining.count() <= 0 || poll(&fd, 1, remaining.count()) <= 0)
+                return false;
+
+            ssize_t n = read(master, chunk.data(), chunk.size());
+
+            if (n <= 0)
+                return false;
+
+            pending.append(chunk.data(), n);
+        }
+    }
+
+    // resident set size in kilobytes, from /proc
+    auto rss() -> long {
+        std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+        std::string line;
+
+        while (std::getline(status, line))
+            if (line.starts_with("VmRSS:"))
+                return std::atol(line.c_str() + 6);
+
+        return 0;
+    }
+};
+
+struct Samples {
+    std::string name;
+    std::vector<double> micros;
+
+    auto add(clock_type::duration d) -> void {
+        micros.push_back(std::chrono::duration<double, std::micro>(d).count());
+    }
+
+    auto percentile(double p) -> double {
+        if (micros.empty())
+            return 0;
+
+        auto sorted = micros;
+        std::ranges::sort(sorted);
+
+        return sorted[std::min(sorted.size() - 1, static_cast<std::size_t>(p * sorted.size()))];
+    }
+
+    auto report() -> void {
+        std::println("  {:<10} {:>6} keys  p50 {:>9.1f} us  p99 {:>9.1f} us  max {:>9.1f} us",
+            name, micros.size(), percentile(0.5), percentile(0.99), percentile(1.0));
+    }
+};
+
+// lines of printable ASCII with a little variety in length, `bytes` long
+auto write_file(const char *path, std::size_t bytes) -> void {
+    std::ofstream out(path, std::ios::binary);
+    std::uint64_t state = 1;
+    std::string line;
+
+    for (std::size_t written = 0; written < bytes; written += line.size() + 1) {
+        state = state * 6364136223846793005 + 1442695040888963407;
+        line.assign(20 + state % 80, ' ');
+
+        for (auto& c: line)
+            c = "abcdefghijklmnopqrstuvwxyz      "[(state = state * 6364136223846793005 + 1) >> 59];
+
+        out << line << '\n';
+    }
+}
+
+// a keystroke and the kind of work it asks for; never S or Q, so the
+// edited file is left alone and the session outlives the script
+struct Key {
+    std::string_view keys;
+    int kind;
+};
+
+constexpr std::array<std::string_view, 4> kinds = {"insert", "delete", "motion", "newline"};
+
+constexpr std::array<Key, 16> script = {{
+    {"h", 0}, {"e", 0}, {"y", 0}, {"\x7f", 1},
+    {"N", 2}, {"N", 2}, {"E", 2}, {"x", 0},
+    {"\n", 3}, {"z", 0}, {"P", 2}, {"A", 2},
+    {"V", 2}, {"C", 2}, {"F", 2}, {"B", 2},
+}};
+
+auto main(int argc, char *argv[]) -> int {
+    const char *program = "./epp";
+    int count = 2000;
+    int option;
+
+    while ((option = getopt(argc, argv, "e:n:")) != -1) {
+        switch (option) {
+        case 'e':
+            program = optarg;
+            break;
+        case 'n':
+            count = std::max(1, std::atoi(optarg));
+            break;
+        default:
+            std::println(stderr, "usage: {} [-e epp] [-n keys]", argv[0]);
+            return 1;
+        }
+    }
+
+    if (access(program, X_OK) != 0) {
+        std::println(stderr, "{}: not executable", program);
+        return 1;
+    }
+
+    const char *path = "/tmp/epp-latency.txt";
+    State state;
+
+    if (state.directory.empty()) {
+        std::println(stderr, "no state directory for epp");
+        return 1;
+    }
+
+    for (std::size_t megabytes: {0, 1, 16, 128}) {
+        write_file(path, megabytes << 20);
+
+        auto start = clock_type::now();
+        Session session(program, path, state.directory.c_str(), 120, 40);
+
+        if (session.pid < 0 || !session.wait_frame(std::chrono::milliseconds{60000})) {
+            std::println(stderr, "{}: no first frame", program);
+            return 1;
+        }
+
+        auto startup = clock_type::now() - start;
+
+        std::println("{} MB: first frame {:.1f} ms, rss {} kB", megabytes,
+            std::chrono::duration<double, std::milli>(startup).count(), session.rss());
+
+        std::array<Samples, kinds.size()> samples;
+        Samples all{"all", {}};
+
+        for (std::size_t i = 0; i < kinds.size(); ++i)
+            samples[i].name = kinds[i];
+
+        for (int i = 0; i < count; ++i) {
+            auto& key = script[i % script.size()];
+            auto sent = clock_type::now();
+
+            session.send(key.keys);
+
+            if (!session.wait_frame()) {
+                std::println(stderr, "no frame after key {}", i);
+                return 1;
+            }
+
+            auto elapsed = clock_type::now() - sent;
+
+            samples[key.kind].add(elapsed);
+            all.add(elapsed);
+        }
+
+        for (auto& s: samples)
+            s.report();
+
+        all.report();
+    }
+
+    unlink(path);
+
+    return 0;
+}